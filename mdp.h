@@ -32,7 +32,9 @@
 
 //  Classes listed in alphabetical order
 
+#include "mdp_broker.h"
 #include "mdp_client.h"
+#include "mdp_props.h"
 #include "mdp_worker.h"
 
 #endif
@@ -0,0 +1,352 @@
+/*  =========================================================================
+    mdp_bench.c - Majordomo Protocol broker benchmarks
+
+    -------------------------------------------------------------------------
+    Copyright (c) 1991-2012 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of the Majordomo Project: http://majordomo.zeromq.org,
+    an implementation of rfc.zeromq.org/spec:18/MDP (MDP/0.2) in C.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 3 of the License, or (at your
+    option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program. If not, see <http://www.gnu.org/licenses/>.
+    =========================================================================
+*/
+
+// The benchmarks time the broker's own internals, which are static, so we
+// build the broker into this program instead of linking it in.
+#include "mdp_broker.c"
+
+#define BENCH_MESSAGES      1000000 //  Messages timed per run
+#define BENCH_BATCH         1000    //  Requests sent between reports
+#define BENCH_CAPACITY      4       //  Requests per worker, when not one
+
+static size_t s_bench_workers[] = { 10, 100, 1000, 10000, 50000 };
+
+// Makes a routing id as libzmq does for a peer without an identity: a
+// zero byte, then a 32-bit counter
+static zframe_t *
+s_bench_address(uint32_t id)
+{
+  byte data[5] = {
+    0, (byte) (id >> 24), (byte) (id >> 16), (byte) (id >> 8), (byte) id
+  };
+  return zframe_new(data, sizeof(data));
+}
+
+// Looks up the sender of a HEARTBEAT from each of nbr_workers workers in
+// turn, the way the broker used to, with a zhash keyed by the hex form of
+// the routing id, and the way it does now. The broker used to look the
+// worker up twice per message: once to see if it was ready, and again to
+// fetch it.
+static void
+s_bench_lookup(size_t nbr_workers, size_t messages)
+{
+  zframe_t **addresses = (zframe_t **)zmalloc(nbr_workers * sizeof(zframe_t *));
+  zhash_t *hashed = zhash_new();
+  index_t *index = s_index_new();
+
+  for (size_t worker = 0; worker < nbr_workers; worker++) {
+    addresses[worker] = s_bench_address((uint32_t) worker);
+    zframe_t *address = addresses[worker];
+    char *identity = zframe_strhex(address);
+    zhash_insert(hashed, identity, address);
+    free(identity);
+    s_index_insert(index, zframe_data(address), zframe_size(address),
+      s_index_hash(zframe_data(address), zframe_size(address)), address);
+  }
+
+  size_t found = 0;
+  int64_t start = zclock_usecs();
+  for (size_t count = 0; count < messages; count++) {
+    zframe_t *address = addresses[count % nbr_workers];
+    for (int pass = 0; pass < 2; pass++) {
+      char *identity = zframe_strhex(address);
+      found += zhash_lookup(hashed, identity) == address;
+      free(identity);
+    }
+  }
+  int64_t before = zclock_usecs() - start;
+
+  start = zclock_usecs();
+  for (size_t count = 0; count < messages; count++) {
+    zframe_t *address = addresses[count % nbr_workers];
+    uint32_t hash = s_index_hash(zframe_data(address), zframe_size(address));
+    found += s_index_lookup(index, zframe_data(address),
+      zframe_size(address), hash) == address;
+  }
+  int64_t now = zclock_usecs() - start;
+  assert(found == messages * 3);
+
+  printf("lookup    %6zu workers: %8.1f ns/msg before, %8.1f ns/msg now\n",
+    nbr_workers, before * 1000.0 / messages, now * 1000.0 / messages);
+
+  for (size_t worker = 0; worker < nbr_workers; worker++) {
+    zframe_destroy(&addresses[worker]);
+  }
+  free(addresses);
+  zhash_destroy(&hashed);
+  s_index_destroy(&index);
+}
+
+// Makes a message from a worker, as the broker's socket would give it
+static zmsg_t *
+s_bench_worker_msg(zframe_t *address, char *command)
+{
+  zmsg_t *msg = zmsg_new();
+  zframe_t *frame = zframe_dup(address);
+  zmsg_append(msg, &frame);
+  zmsg_addstr(msg, "");
+  zmsg_addstr(msg, MDPW_WORKER);
+  zmsg_addstr(msg, command);
+  return msg;
+}
+
+// Makes a broker with nbr_workers workers registered for one service,
+// each taking up to capacity requests at once. The broker has a socket,
+// but nothing connects to it, so what it sends goes nowhere.
+static broker_t *
+s_bench_broker(zframe_t **addresses, size_t nbr_workers, size_t capacity)
+{
+  settings_t settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.max_inflight = capacity;
+  settings.batch = BROKER_BATCH;
+  settings.max_reissues = WORKER_REISSUES;
+  broker_t *broker = s_broker_new(s_router_new(0), &settings);
+
+  for (size_t worker = 0; worker < nbr_workers; worker++) {
+    addresses[worker] = s_bench_address((uint32_t) worker);
+    zmsg_t *msg = s_bench_worker_msg(addresses[worker], MDPW_READY);
+    zmsg_addstr(msg, "echo");
+    s_broker_process(broker, broker->socket, msg);
+  }
+  assert(broker->workers->size == nbr_workers);
+  return broker;
+}
+
+static void
+s_bench_destroy(broker_t **broker_p, zframe_t **addresses, size_t nbr_workers)
+{
+  for (size_t worker = 0; worker < nbr_workers; worker++) {
+    zframe_destroy(&addresses[worker]);
+  }
+  free(addresses);
+  s_broker_destroy(broker_p);
+}
+
+// Each of nbr_workers workers sends a HEARTBEAT, then the broker's clock
+// moves on one heartbeat interval, so its timers send each worker one,
+// and so on. Both sides should cost the same per worker however many
+// workers there are: a lookup and a timestamp for each HEARTBEAT in, and
+// a timer for each one out.
+static void
+s_bench_heartbeat(size_t nbr_workers, size_t messages)
+{
+  zframe_t **addresses = (zframe_t **)zmalloc(nbr_workers * sizeof(zframe_t *));
+  broker_t *broker = s_bench_broker(addresses, nbr_workers,
+    WORKER_MAX_INFLIGHT);
+  zmsg_t **batch = (zmsg_t **)zmalloc(nbr_workers * sizeof(zmsg_t *));
+
+  size_t rounds = messages > nbr_workers? messages / nbr_workers: 1;
+  int64_t received = 0;
+  int64_t sent = 0;
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t worker = 0; worker < nbr_workers; worker++) {
+      batch[worker] = s_bench_worker_msg(addresses[worker], MDPW_HEARTBEAT);
+    }
+    int64_t start = zclock_usecs();
+    for (size_t worker = 0; worker < nbr_workers; worker++) {
+      s_broker_process(broker, broker->socket, batch[worker]);
+    }
+    received += zclock_usecs() - start;
+
+    start = zclock_usecs();
+    s_wheel_advance(broker->wheel,
+      s_wheel_time(broker->wheel) + HEARTBEAT_INTERVAL);
+    sent += zclock_usecs() - start;
+  }
+  //  Nobody expired, so every HEARTBEAT went to a known worker
+  assert(broker->workers->size == nbr_workers);
+
+  printf("heartbeat %6zu workers: %8.1f ns/msg in, %8.1f ns/msg out\n",
+    nbr_workers, received * 1000.0 / (rounds * nbr_workers),
+    sent * 1000.0 / (rounds * nbr_workers));
+
+  free(batch);
+  s_bench_destroy(&broker, addresses, nbr_workers);
+}
+
+// Makes a request from the client, as the broker's socket would give it:
+// [client][""][MDPC0X][props][service][command][id], with props only if
+// the request has a key
+static zmsg_t *
+s_bench_request(zframe_t *client, mdp_props_t *props, size_t id)
+{
+  zmsg_t *msg = zmsg_new();
+  zframe_t *frame = zframe_dup(client);
+  zmsg_append(msg, &frame);
+  zmsg_addstr(msg, "");
+  zmsg_addstr(msg, MDPC_CLIENT);
+  if (props) {
+    frame = mdp_props_frame(props);
+    zmsg_append(msg, &frame);
+  }
+  zmsg_addstr(msg, "echo");
+  zmsg_addstr(msg, "get");
+  zmsg_addstrf(msg, "%zu", id);
+  return msg;
+}
+
+// Makes a worker's report on the last request it was sent:
+// [worker][""][MDPW0X][REPORT][token][""][body], with the token the
+// worker got
+static zmsg_t *
+s_bench_report(zframe_t *address, worker_t *worker, zframe_t *client)
+{
+  zmsg_t *msg = s_bench_worker_msg(address, MDPW_REPORT);
+  zframe_t *token = s_token_new(client, NULL);
+  s_token_set_dispatch(token, worker->dispatches[worker->inflight - 1].id);
+  zmsg_append(msg, &token);
+  zmsg_addstr(msg, "");
+  zmsg_addstr(msg, "ok");
+  return msg;
+}
+
+// Sends requests to a service of nbr_workers workers, up to one per worker
+// and BENCH_BATCH at a time, then has the workers that got them report.
+// Returns the nsecs each request and its report took the broker. A keyed
+// request scores the 256 key groups for its key, then the waiting workers
+// of the group it picks, so its cost grows with the workers per group; an
+// unkeyed one goes to the top of the waiting heap. With a capacity over
+// one, each worker first ramps up to it and then holds one request less,
+// so every waiting worker has requests in flight when we time it.
+static double
+s_bench_requests(size_t nbr_workers, size_t messages, int keyed,
+  size_t capacity)
+{
+  zframe_t **addresses = (zframe_t **)zmalloc(nbr_workers * sizeof(zframe_t *));
+  broker_t *broker = s_bench_broker(addresses, nbr_workers, capacity);
+  worker_t **workers = (worker_t **)zmalloc(nbr_workers * sizeof(worker_t *));
+  for (size_t worker = 0; worker < nbr_workers; worker++) {
+    zframe_t *address = addresses[worker];
+    workers[worker] = (worker_t *)s_index_lookup(broker->workers,
+      zframe_data(address), zframe_size(address),
+      s_index_hash(zframe_data(address), zframe_size(address)));
+  }
+  size_t batch_size = nbr_workers < BENCH_BATCH? nbr_workers: BENCH_BATCH;
+  zmsg_t **batch = (zmsg_t **)zmalloc(batch_size * sizeof(zmsg_t *));
+  zframe_t *client = s_bench_address(UINT32_MAX);
+  mdp_props_t props;
+  mdp_props_init(&props);
+  mdp_props_put_number(&props, MDP_PROPS_KEY, 1);
+
+  //  Each report lets a worker take one more request, up to its capacity
+  size_t held = capacity - 1;
+  for (size_t round = 0; round < held; round++) {
+    for (size_t worker = 0; worker < nbr_workers; worker++) {
+      s_broker_process(broker, broker->socket,
+        s_bench_request(client, NULL, worker));
+    }
+    for (size_t worker = 0; worker < nbr_workers; worker++) {
+      s_broker_process(broker, broker->socket,
+        s_bench_report(addresses[worker], workers[worker], client));
+    }
+  }
+  for (size_t request = 0; request < nbr_workers * held; request++) {
+    s_broker_process(broker, broker->socket,
+      s_bench_request(client, NULL, request));
+  }
+  service_t *service = workers[0]->service;
+  size_t completed = service->completed;
+
+  size_t requests = 0;
+  int64_t elapsed = 0;
+  while (requests < messages) {
+    for (size_t index = 0; index < batch_size; index++) {
+      batch[index] = s_bench_request(client, keyed? &props: NULL,
+        requests + index);
+    }
+    int64_t start = zclock_usecs();
+    for (size_t index = 0; index < batch_size; index++) {
+      s_broker_process(broker, broker->socket, batch[index]);
+    }
+    elapsed += zclock_usecs() - start;
+
+    size_t busy = 0;
+    for (size_t worker = 0; worker < nbr_workers; worker++) {
+      if (workers[worker]->inflight > held) {
+        batch[busy++] = s_bench_report(addresses[worker], workers[worker],
+          client);
+      }
+    }
+    assert(busy == batch_size);
+    start = zclock_usecs();
+    for (size_t index = 0; index < batch_size; index++) {
+      s_broker_process(broker, broker->socket, batch[index]);
+    }
+    elapsed += zclock_usecs() - start;
+    requests += batch_size;
+  }
+  assert(service->completed == completed + requests);
+
+  zframe_destroy(&client);
+  free(batch);
+  free(workers);
+  s_bench_destroy(&broker, addresses, nbr_workers);
+  return elapsed * 1000.0 / requests;
+}
+
+static void
+s_bench_dispatch(size_t nbr_workers, size_t messages)
+{
+  double unkeyed = s_bench_requests(nbr_workers, messages, 0, 1);
+  double keyed = s_bench_requests(nbr_workers, messages, 1, 1);
+  double loaded = s_bench_requests(nbr_workers, messages, 0, BENCH_CAPACITY);
+  printf("dispatch  %6zu workers: %8.1f ns/req unkeyed, %8.1f ns/req keyed,"
+    " %8.1f ns/req at capacity %d\n",
+    nbr_workers, unkeyed, keyed, loaded, BENCH_CAPACITY);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t messages = BENCH_MESSAGES;
+
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "-n") && i + 1 < argc) {
+      messages = (size_t) atol(argv[++i]);
+    }
+    else {
+      printf("%s [-h] | [-n messages]\n"
+        "\t-h This help message\n"
+        "\t-n Messages timed per run, defaults to %d\n",
+        argv[0], BENCH_MESSAGES);
+      return -1;
+    }
+  }
+  if (messages < 1) {
+    messages = 1;
+  }
+
+  size_t runs = sizeof(s_bench_workers) / sizeof(s_bench_workers[0]);
+  for (size_t run = 0; run < runs; run++) {
+    s_bench_lookup(s_bench_workers[run], messages);
+  }
+  for (size_t run = 0; run < runs; run++) {
+    s_bench_heartbeat(s_bench_workers[run], messages);
+  }
+  for (size_t run = 0; run < runs; run++) {
+    s_bench_dispatch(s_bench_workers[run], messages);
+  }
+  return 0;
+}
@@ -29,100 +29,688 @@
 // A minimal C implementation of the Majordomo Protocol as defined in
 // http://rfc.zeromq.org/spec:7 and http://rfc.zeromq.org/spec:8.
 //
-#include <unistd.h>
 #include "mdp_common.h"
+#include "mdp_props.h"
+#include "mdp_broker.h"
 
 // We'd normally pull these from config data
 #define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
 #define HEARTBEAT_INTERVAL  2500    //  msecs
 #define HEARTBEAT_EXPIRY    HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS
+#define WORKER_MAX_INFLIGHT 1       //  Requests per worker at once
+#define WORKER_CAPACITY_MAX 1024    //  Most a worker may ask for
+#define WORKER_REISSUES     1       //  Times a request goes out again when
+                                    //  its worker dies on it
+#define KEY_GROUPS          256     //  Groups of a service's workers that
+                                    //  keyed requests choose between first
+#define INDEX_INITIAL_SIZE  256     //  Slots, must be a power of two
+#define SERVICE_MAX         1024    //  Services known at once
+#define SERVICE_EXPIRY      60000   //  msecs a service lives without workers
+#define SERVICE_CACHE_SIZE  4       //  Recently used services
+#define FILTER_RULE_MAX     255     //  Longest command filter rule
+#define FILTER_PREFIX_MAX   64      //  Longest prefix rule kept hashed
+#define WHEEL_TICK          10      //  msecs per timer wheel tick
+#define WHEEL_BITS          8       //  Slots per wheel level, as a power of 2
+#define WHEEL_SIZE          (1 << WHEEL_BITS)
+#define WHEEL_LEVELS        3       //  Reaches 10 msecs * 256^3, ~46 hours
+#define SHARD_MAX           64      //  Broker threads in sharded mode
+#define BROKER_BATCH        64      //  Messages read per wakeup
+#define PEER_MAX            16      //  Peer brokers we forward to
+#define QUEUE_MAX           10000   //  Requests queued per service
+#define QUEUE_BYTES_MAX     (64 * 1024 * 1024)
+#define TOTAL_MAX           100000  //  Requests queued in the broker
+#define TOTAL_BYTES_MAX     (256 * 1024 * 1024)
+#define CACHE_BYTES_MAX     (64 * 1024 * 1024)
+#define PRIORITY_CLASSES    3       //  0 interactive, 1 normal, 2 bulk
+#define PRIORITY_DEFAULT    1       //  For requests without a priority
+#define HISTOGRAM_SUB_BITS  3       //  Log2 of buckets per power of two
+#define HISTOGRAM_SUB       (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS   ((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
 
+//  What to do with a request when its queue is full
+#define OVERFLOW_NAK        0       //  NAK it as busy
+#define OVERFLOW_DROP_OLDEST 1      //  NAK the oldest queued request instead
+#define OVERFLOW_DROP_NEWEST 2      //  Drop it without a reply
 
-// The broker class defines a single broker instance
+//  Status codes at the start of a NAK body
+#define NAK_FORBIDDEN       "403"   //  Command is disabled
+#define NAK_NOT_FOUND       "404"   //  Service went away
+#define NAK_BUSY            "503"   //  Queue or service table is full
+#define NAK_FAILED          "500"   //  Workers died on it too often
+
+
+typedef struct _worker_t worker_t;
+typedef struct _peer_t peer_t;
+typedef struct _cache_entry_t cache_entry_t;
+
+// The index class maps byte strings, such as raw routing ids and service
+// names, to items. It is an open addressing table with linear probing, so
+// looking up the key held in a frame costs one hash over its bytes and no
+// allocation. Keys are owned by the items and must outlive their entry.
+typedef struct {
+  const byte *key;            //  Key bytes, owned by the item
+  size_t size;                //  Size of key
+  uint32_t hash;              //  Hash of key
+  void *item;                 //  Item, NULL where the slot is free
+} index_slot_t;
+
+typedef struct {
+  index_slot_t *slots;        //  Table of slots
+  size_t limit;               //  Number of slots, a power of two
+  size_t size;                //  Number of items held
+} index_t;
+
+static index_t *
+  s_index_new(void);
+static void
+  s_index_destroy(index_t **self_p);
+static uint32_t
+  s_index_hash(const byte *key, size_t size);
+static void *
+  s_index_lookup(index_t *self, const byte *key, size_t size, uint32_t hash);
+static void
+  s_index_insert(index_t *self, const byte *key, size_t size, uint32_t hash,
+    void *item);
+static void
+  s_index_delete(index_t *self, void *item, uint32_t hash);
+
+
+// The timer class is embedded in the object it times, so arming and
+// cancelling a timer never allocates. An armed timer sits on one slot list
+// of the wheel.
+typedef struct _wheel_timer_t wheel_timer_t;
+typedef void (wheel_fn)(wheel_timer_t *timer, void *arg);
+
+struct _wheel_timer_t {
+  wheel_timer_t *next;        //  Next timer in slot, NULL if not armed
+  wheel_timer_t *prev;        //  Previous timer in slot
+  int64_t expires;            //  Tick at which the timer fires
+  wheel_fn *handler;          //  Called when the timer fires
+  void *arg;                  //  Argument for handler
+};
+
+// The wheel class is a hierarchical timer wheel. Level 0 has one slot per
+// tick; each higher level has one slot per turn of the level below, and
+// its timers cascade down as that turn comes round. Arming, cancelling and
+// firing a timer are all O(1), however many workers we hold.
+typedef struct {
+  wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SIZE];  //  Slot list heads
+  int64_t now;                //  Current tick
+} wheel_t;
+
+static wheel_t *
+  s_wheel_new(int64_t now);
+static void
+  s_wheel_destroy(wheel_t **self_p);
+static int64_t
+  s_wheel_time(wheel_t *self);
+static void
+  s_wheel_add(wheel_t *self, wheel_timer_t *timer, int64_t when);
+static void
+  s_wheel_cancel(wheel_timer_t *timer);
+static void
+  s_wheel_advance(wheel_t *self, int64_t now);
+static int
+  s_wheel_timeout(wheel_t *self);
+
+
+// The filter class holds the disabled commands of a service. Exact names
+// and prefix rules ("PO*") are hashed, so a command is checked in a single
+// pass over its bytes, however many rules there are. Other wildcard rules
+// ("*Save", "PO?elect") are rare and matched one by one.
+typedef struct {
+  index_t *exact;             //  Disabled command names
+  index_t *prefixes;          //  Disabled command prefixes
+  size_t lengths[FILTER_PREFIX_MAX + 1];  //  Prefix rules per length
+  zlist_t *patterns;          //  Other wildcard rules
+  size_t rules;               //  Number of rules held
+} filter_t;
+
+static filter_t *
+  s_filter_new(void);
+static void
+  s_filter_destroy(filter_t **self_p);
+static int
+  s_filter_valid(zframe_t *rule);
+static void
+  s_filter_add(filter_t *self, zframe_t *rule);
+static void
+  s_filter_remove(filter_t *self, zframe_t *rule);
+static int
+  s_filter_match(filter_t *self, zframe_t *command);
+static char *
+  s_filter_update(filter_t **self_p, zframe_t *operation, zmsg_t *rules,
+    char *add_name, char *remove_name);
+
+
+// The histogram class counts samples, in usecs, in log-linear buckets as
+// HDR histograms do. Each power of two is split into HISTOGRAM_SUB
+// buckets, so a sample is known to within 1/HISTOGRAM_SUB of its value,
+// and recording one costs a bit scan and an increment. Samples are capped
+// at 2^32 usecs, over an hour.
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS]; //  Samples per bucket
+  uint64_t samples;           //  Samples in all
+  int64_t max;                //  Largest sample
+} histogram_t;
+
+static void
+  s_histogram_record(histogram_t *self, int64_t value);
+static int64_t
+  s_histogram_lowest(size_t bucket);
+static int64_t
+  s_histogram_percentile(histogram_t *self, double percentile);
+static void
+  s_histogram_dump(histogram_t *self, zmsg_t *msg);
+
+
+// Broker settings, as given to mdp_broker_t. Limits of zero mean no
+// limit.
+typedef struct {
+  int verbose;                //  Print activity to stdout
+  size_t max_inflight;        //  Capacity of workers that do not say
+  size_t batch;               //  Messages read per wakeup
+  size_t queue_max;           //  Requests queued per service
+  size_t queue_bytes_max;     //  Bytes queued per service
+  size_t total_max;           //  Requests queued in the broker
+  size_t total_bytes_max;     //  Bytes queued in the broker
+  int overflow;               //  OVERFLOW_NAK..OVERFLOW_DROP_NEWEST
+  int frontend_hwm;           //  HWM of the client socket, 0 for default
+  int backend_hwm;            //  HWM of the worker socket, 0 for default
+  size_t cache_bytes_max;     //  Memory for cached reports, 0 for no cache
+  size_t max_reissues;        //  Times a request may go out again
+  char *peers[PEER_MAX];      //  Frontends of peer brokers
+  size_t nbr_peers;           //  How many peers we have
+} settings_t;
+
+// The broker class defines a single broker instance. Clients and workers
+// share one socket, as in MDP, unless the broker binds a separate backend
+// socket for workers. Then each socket has its own queues and HWM, and
+// heartbeats do not wait behind client traffic.
 typedef struct {
-  zsock_t *socket;            //  Socket for clients & workers
+  zsock_t *socket;            //  Socket for clients, and workers
+  zsock_t *backend;           //  Socket for workers, may be socket
+  zsock_t *pipe;              //  Actor pipe, when embedded, else NULL
   int verbose;                //  Print activity to stdout
+  int sharded;                //  Runs as one shard behind a front thread
   char *endpoint;             //  Broker binds to this endpoint
-  zhash_t *services;          //  Hash of known services
-  zhash_t *workers;           //  Hash of known workers
-  zlist_t *waiting;           //  List of waiting workers
-  uint64_t heartbeat_at;      //  When to send HEARTBEAT
+  index_t *services;          //  Index of known services
+  index_t *workers;           //  Index of known workers
+  wheel_t *wheel;             //  Heartbeat and expiry timers
+  wheel_timer_t purge_timer;  //  When to purge unused services
+  peer_t *peers[PEER_MAX];    //  Peer brokers
+  size_t nbr_peers;           //  How many peers we have
+  wheel_timer_t peer_timer;   //  When to ask the peers for their services
+  int64_t clock;              //  Usecs at this wakeup, for statistics
+  size_t max_inflight;        //  Capacity of workers that do not say
+  size_t batch;               //  Messages read per wakeup
+  size_t max_reissues;        //  Times a request may go out again
+
+  //  Queue limits, from settings_t
+  size_t queue_max;           //  Requests queued per service
+  size_t queue_bytes_max;     //  Bytes queued per service
+  size_t total_max;           //  Requests queued in the broker
+  size_t total_bytes_max;     //  Bytes queued in the broker
+  int overflow;               //  OVERFLOW_NAK..OVERFLOW_DROP_NEWEST
+  size_t queued;              //  Requests queued in the broker
+  size_t queued_bytes;        //  Bytes queued in the broker
+
+  //  Cached reports of all services, most recently used first
+  cache_entry_t *cache_head;  //  Most recently used entry
+  cache_entry_t *cache_tail;  //  Least recently used entry
+  size_t cache_bytes;         //  Memory the entries hold
+  size_t cache_bytes_max;     //  Limit on it, 0 for no cache
+
+  //  Services resolved most recently, checked before broker->services
+  void *recent[SERVICE_CACHE_SIZE];
+  size_t recent_next;         //  Cache entry to replace next
+
+  //  Envelope frames are allocated once and sent with ZFRAME_REUSE
+  zframe_t *empty;            //  Empty delimiter
+  zframe_t *client_header;    //  MDPC_CLIENT
+  zframe_t *worker_header;    //  MDPW_WORKER
+  zframe_t *client_commands[4];   //  MDPC_REQUEST..MDPC_NAK
+  zframe_t *worker_commands[6];   //  MDPW_READY..MDPW_DISCONNECT
 } broker_t;
 
 static broker_t *
-  s_broker_new(int verbose);
+  s_broker_new(zsock_t *socket, settings_t *settings);
 static void
   s_broker_destroy(broker_t **self_p);
-static void
+static int
   s_broker_bind(broker_t *self, char *endpoint);
+static int
+  s_broker_bind_backend(broker_t *self, char *endpoint, int hwm);
+static void
+  s_broker_run(broker_t *self);
+static int
+  s_broker_drain(broker_t *self, zsock_t *socket);
+static void
+  s_broker_process(broker_t *self, zsock_t *socket, zmsg_t *msg);
 static void
   s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg);
 static void
   s_broker_client_msg(broker_t *self, zframe_t *sender, zmsg_t *msg);
 static void
-  s_broker_purge(broker_t *self);
+  s_broker_client_send(broker_t *self, zframe_t *client, char *command,
+    char *status, zframe_t *service_frame, zmsg_t **msg_p);
+static int
+  s_broker_forward(broker_t *self, zframe_t *client, zframe_t *props,
+    zframe_t *service_frame, zmsg_t **msg_p);
+static zframe_t *
+  s_token_new(zframe_t *sender, zframe_t *props);
+static uint32_t
+  s_token_flight(zframe_t *token);
+static uint32_t
+  s_token_dispatch(zframe_t *token);
+static void
+  s_token_set_dispatch(zframe_t *token, uint32_t id);
+static void
+  s_send_frame(zsock_t *socket, zframe_t *frame, int flags);
+static zmsg_t *
+  s_recv_nowait(zsock_t *socket);
+static zsock_t *
+  s_router_new(int hwm);
+static int
+  s_pipe_terminated(zsock_t *pipe);
+static void
+  s_broker_purge_services(wheel_timer_t *timer, void *arg);
+static void
+  s_broker_poll_peers(wheel_timer_t *timer, void *arg);
+
+
+// The request class holds a client request while it is queued, and a copy
+// of it while it is with a worker, so that we can send it to another
+// worker if that one dies
+typedef struct {
+  zmsg_t *msg;                //  Client address, empty frame and body
+  size_t size;                //  Bytes in msg
+  int64_t deadline;           //  When the client gives up, or 0 if never
+  int64_t queued_at;          //  When we queued it, in usecs
+  int priority;               //  Priority class
+  int keyed;                  //  Goes to the worker its key prefers
+  uint32_t key;               //  Hash of its affinity key, if keyed
+  size_t reissues;            //  Times it went out again
+} request_t;
+
+// Each priority class gets a share of dispatches in proportion to its
+// weight, while it has requests queued, so bulk work is slowed down by
+// interactive work but never starved by it.
+static int s_priority_weights[PRIORITY_CLASSES] = { 8, 3, 1 };
+
+// Queue time statistics of a priority class
+typedef struct {
+  size_t dispatched;          //  Requests sent to workers
+  int64_t wait_total;         //  Usecs they waited, in all
+  int64_t wait_max;           //  Longest wait, usecs
+} wait_stats_t;
+
+static void
+  s_request_destroy(request_t **self_p);
+
+
+// A flight is a request that clients share while it is queued or with a
+// worker, because they all sent the same body for a command the service
+// coalesces. The first client's request is the one that goes to a worker,
+// and the flight id goes with it in its token; the others wait here, as
+// passengers. If the first client gives up while the request is queued,
+// the next passenger takes over the request.
+typedef struct {
+  zframe_t *client;           //  Token of the client
+  int64_t deadline;           //  When the client gives up, or 0 if never
+} passenger_t;
+
+typedef struct {
+  byte *body;                 //  Request body, as the index key
+  size_t size;                //  Size of body key
+  uint32_t hash;              //  Hash of body key
+  byte id[4];                 //  Flight id, in network order
+  zlist_t *clients;           //  Clients that joined, as passengers
+  int cacheable;              //  Its report goes into the cache
+  uint32_t epoch;             //  Cache epoch of the service at takeoff
+} flight_t;
+
+static void
+  s_flight_destroy(flight_t **self_p);
+
+
+// Keyed requests pick one of KEY_GROUPS groups of the service's workers
+// first, and then a worker within the group, so that they score a few
+// hundred groups and workers rather than every waiting worker. A worker
+// belongs to the group its address hashes to. The group keeps what the
+// score needs of its waiting workers in an array, so scoring them does
+// not touch each worker.
+typedef struct {
+  uint32_t hash;              //  Hash of the worker's address
+  size_t weight;              //  Weight of the worker
+  worker_t *worker;           //  The worker
+} key_member_t;
 
+typedef struct {
+  key_member_t *waiting;      //  Waiting workers of the group
+  size_t size;                //  How many are waiting
+  size_t limit;               //  Room in the array
+  size_t weight;              //  Sum of the weights of all its workers
+} key_group_t;
 
 //  The service class defines a single service instance
 typedef struct {
   broker_t *broker;           //  Broker instance
   char *name;                 //  Service name
-  zlist_t *requests;          //  List of client requests
-  zlist_t *waiting;           //  List of waiting workers
+  zframe_t *frame;            //  Service name, interned as a frame
+  uint32_t hash;              //  Hash of name, for the index
+  zlist_t *requests[PRIORITY_CLASSES];  //  Client requests, per class
+  size_t queued;              //  Requests queued over all classes
+  int credit[PRIORITY_CLASSES];   //  Weighted round robin state
+  wait_stats_t waits[PRIORITY_CLASSES];   //  Queue time, per class
+  size_t bytes;               //  Size of queued requests
+  size_t dropped;             //  Requests refused or dropped as busy
+  size_t expired;             //  Requests dropped past their deadline
+  size_t completed;           //  Requests workers reported back on
+  size_t naks;                //  NAKs sent to clients
+  size_t coalesced;           //  Requests that joined a flight
+  size_t hits;                //  Requests answered from the cache
+  size_t misses;              //  Cacheable requests that were not
+  size_t reissued;            //  Requests sent again as a worker died
+  histogram_t wait_times;     //  Time requests spent queued
+  histogram_t service_times;  //  Time workers took over requests
+  worker_t **waiting;         //  Workers with spare capacity, as a heap
+  size_t nbr_waiting;         //  How many are waiting
+  size_t waiting_limit;       //  Room in the heap
+  size_t turns;               //  Times a worker started waiting
+  key_group_t groups[KEY_GROUPS];   //  Workers by key group
   size_t workers;             //  How many workers we have
-  zlist_t *blacklist;
+  int64_t expiry;             //  Expires at unless it has workers
+  filter_t *filter;           //  Disabled commands, if any
+  filter_t *coalesce;         //  Commands to coalesce, if any
+  index_t *flights;           //  Flights by body, once there are any
+  index_t *flight_ids;        //  Flights by id
+  uint32_t next_flight;       //  Id of the last flight
+  filter_t *cacheable;        //  Commands whose reports we cache, if any
+  int64_t cache_ttl;          //  How long we keep their reports, msecs
+  index_t *cache;             //  Cached reports by body, once there are any
+  uint32_t cache_epoch;       //  Changes when cached reports are dropped
 } service_t;
 
+static service_t *
+  s_service_lookup(broker_t *self, zframe_t *service_frame);
 static service_t *
   s_service_require(broker_t *self, zframe_t *service_frame);
 static void
-  s_service_destroy(void *argument);
+  s_service_delete(service_t *self);
 static void
-  s_service_dispatch(service_t *service);
+  s_service_destroy(service_t **self_p);
+static void
+  s_service_enqueue(service_t *self, zframe_t **client_p, zframe_t *props,
+    zmsg_t **msg_p);
+static request_t *
+  s_service_dequeue(service_t *self);
+static request_t *
+  s_service_evict(service_t *self);
 static void
-  s_service_enable_command(service_t *self, const char *command);
+  s_service_unqueue(service_t *self, request_t *request);
 static void
-  s_service_disable_command(service_t *self, const char *command);
+  s_service_requeue(service_t *self, request_t *request);
 static int
-  s_service_is_command_enabled(service_t *self, const char *command);
+  s_service_is_full(service_t *self, size_t size);
+static void
+  s_service_dispatch(service_t *service);
+static worker_t *
+  s_service_select(service_t *self, request_t *request);
+static void
+  s_service_reorder(service_t *self, size_t slot);
+static int
+  s_service_is_command_enabled(service_t *self, zframe_t *command);
+static int
+  s_service_join(service_t *self, zframe_t *client, int64_t deadline,
+    zmsg_t **msg_p);
+static flight_t *
+  s_service_flight(service_t *self, uint32_t id);
+static flight_t *
+  s_service_land(service_t *self, uint32_t id);
+static int
+  s_service_promote(service_t *self, request_t *request, int64_t now);
+static void
+  s_service_reply(service_t *self, zframe_t *client, char *command,
+    char *status, zmsg_t **msg_p);
+static void
+  s_service_store(service_t *self, flight_t *flight, zmsg_t *msg);
+static char *
+  s_service_invalidate(service_t *self, zmsg_t *rules);
 
 
-//  The worker class defines a single worker, idle or active
+// A cache entry is a worker's report on a request for a command that its
+// service caches, kept until its TTL runs out or we need the memory back.
+// The entries of all services share one LRU list in the broker, and we
+// evict from its tail.
+struct _cache_entry_t {
+  service_t *service;         //  Owning service
+  byte *key;                  //  Request body, as the index key
+  size_t size;                //  Size of key
+  uint32_t hash;              //  Hash of key
+  zmsg_t *report;             //  Report body, sent as a copy
+  size_t bytes;               //  Memory held, counted against the limit
+  int64_t expiry;             //  Stale after this
+  cache_entry_t *next;        //  Next entry, less recently used
+  cache_entry_t *prev;        //  Previous entry, more recently used
+};
+
+static void
+  s_cache_entry_evict(cache_entry_t *self);
+static void
+  s_cache_entry_destroy(cache_entry_t **self_p);
+static void
+  s_cache_entry_touch(cache_entry_t *self);
+
+
+// When a request in flight went out, and under which dispatch id, so we
+// can time the worker when its report comes back, and send the request
+// again if the worker dies first
 typedef struct {
+  uint32_t id;                //  Dispatch id, as in its token
+  uint32_t flight;            //  Flight the request leads, or 0
+  int64_t started;            //  When we sent the request, in usecs
+  request_t *request;         //  The request, if we may reissue it
+} dispatch_t;
+
+//  The worker class defines a single worker, idle or active
+struct _worker_t {
   broker_t *broker;           //  Broker instance
   char *identity;             //  Identity of worker
   zframe_t *address;          //  Address frame to route to
+  uint32_t hash;              //  Hash of address, for the index
   service_t *service;         //  Owning service, if known
-  int64_t expiry;             //  Expires at unless heartbeat
-} worker_t;
+  int64_t expiry;             //  Expires at unless we hear from it
+  int64_t sent_at;            //  When we last sent it a message
+  wheel_timer_t expiry_timer; //  Checks for expiry
+  wheel_timer_t heartbeat_timer;  //  Sends HEARTBEAT on a quiet line
+  size_t inflight;            //  Requests dispatched, not yet reported
+  size_t capacity;            //  Most requests it takes at once
+  size_t limit;               //  Requests it takes at once for now
+  size_t weight;              //  Share of requests, relative to others
+  dispatch_t *dispatches;     //  One per request in flight, up to capacity
+  uint32_t next_dispatch;     //  Id of the last dispatch
+  int waiting;                //  On its service's waiting heap
+  size_t slot;                //  Where it is in the heap, if waiting
+  size_t turn;                //  When it started waiting, for ties
+  size_t group_slot;          //  Where it is in its key group, if waiting
+};
 
 static worker_t *
   s_worker_require(broker_t *self, zframe_t *address);
 static void
   s_worker_delete(worker_t *self, int disconnect);
 static void
-  s_worker_destroy(void *argument);
+  s_worker_destroy(worker_t **self_p);
 static void
-  s_worker_send(worker_t *self, char *command, char *option, zmsg_t *msg);
-/*
+  s_worker_send(worker_t *self, char *command, char *option, zmsg_t **msg_p);
+static void
+  s_worker_send_request(worker_t *self, zframe_t **props_p, zmsg_t *msg);
 static void
   s_worker_waiting(worker_t *self);
-*/
+static void
+  s_worker_unwait(worker_t *self);
+static int
+  s_worker_before(worker_t *self, worker_t *other);
+static void
+  s_worker_expire(wheel_timer_t *timer, void *arg);
+static void
+  s_worker_heartbeat(wheel_timer_t *timer, void *arg);
+static int
+  s_worker_completed(worker_t *self, zframe_t *client);
+static double
+  s_key_score(uint32_t hash, size_t weight, uint32_t key);
+
+
+// The peer class is another broker, that we forward requests to for
+// services we have no workers for. We talk to it as a client would, over
+// a DEALER socket connected to its frontend, and ask it once per heartbeat
+// interval which services it has workers for, and how deep their queues
+// are. A forwarded request carries the token of its client as a tag,
+// which the peer echoes in its reply. Requests that a peer forwarded to
+// us are never forwarded again, so no request takes more than one hop.
+struct _peer_t {
+  broker_t *broker;           //  Broker instance
+  char *endpoint;             //  Frontend of the peer
+  zsock_t *socket;            //  DEALER connected to the peer
+  index_t *services;          //  Services the peer advertises
+};
+
+// A service as a peer last advertised it
+typedef struct {
+  zframe_t *name;             //  Service name, owns the index key
+  uint32_t hash;              //  Hash of name, for the index
+  size_t queued;              //  Requests queued at the peer
+  size_t workers;             //  Workers the peer has for it
+  size_t forwarded;           //  Requests we forwarded since
+  int64_t expiry;             //  Advert is stale after this
+} advert_t;
+
+static peer_t *
+  s_peer_new(broker_t *broker, char *endpoint);
+static void
+  s_peer_destroy(peer_t **self_p);
+static int
+  s_peer_forward(peer_t *self, zframe_t *client, zframe_t *props,
+    zframe_t *service_frame, zmsg_t **msg_p);
+static void
+  s_peer_drain(peer_t *self);
+static void
+  s_peer_recv(peer_t *self, zmsg_t *msg);
+static void
+  s_peer_update(peer_t *self, zmsg_t *msg);
+
+
+// The front class runs a sharded broker. Services are split across shard
+// threads by the hash of their name, and each shard is a broker_t of its
+// own whose socket is its actor pipe. The front thread owns the ROUTER
+// socket and only decides which shard gets each message; whatever a shard
+// sends goes straight back out through the ROUTER. Workers are routed by
+// the service they registered for, which the front remembers per routing
+// id. Messages from a shard that start with an empty frame are meant for
+// the front itself, and carry the address of a worker the shard deleted.
+// Each shard only knows its own services, so the front gathers the
+// shards' answers to mmi.services into one reply.
+typedef struct {
+  zframe_t *address;          //  Worker routing id, owns the index key
+  uint32_t hash;              //  Hash of address, for the index
+  size_t shard;               //  Shard that holds the worker
+} route_t;
+
+typedef struct {
+  zmsg_t *reply;              //  First answer, with the others appended
+  size_t answers;             //  How many shards have answered
+} gather_t;
+
+typedef struct {
+  zsock_t *socket;            //  Socket for clients, and workers
+  zsock_t *backend;           //  Socket for workers, may be socket
+  zsock_t *pipe;              //  Actor pipe, when embedded, else NULL
+  settings_t settings;        //  Settings for the shards
+  zactor_t *shards[SHARD_MAX];    //  Shard threads
+  size_t nbr_shards;          //  How many shards we run
+  index_t *routes;            //  Shard of each registered worker
+  zlist_t *gathers;           //  mmi.services answers being gathered
+  size_t answered[SHARD_MAX];     //  Next gather for each shard
+} front_t;
+
+static front_t *
+  s_front_new(settings_t *settings, size_t nbr_shards);
+static void
+  s_front_destroy(front_t **self_p);
+static int
+  s_front_bind(front_t *self, char *endpoint);
+static int
+  s_front_bind_backend(front_t *self, char *endpoint);
+static void
+  s_front_run(front_t *self);
+static void
+  s_front_drain_socket(front_t *self, zsock_t *socket);
+static void
+  s_front_drain_shard(front_t *self, size_t shard);
+static zmsg_t *
+  s_front_gather(front_t *self, size_t shard, zmsg_t *msg);
+static size_t
+  s_front_route(front_t *self, zmsg_t *msg);
+static size_t
+  s_front_shard(front_t *self, zframe_t *frame);
+static void
+  s_front_forget(front_t *self, zframe_t *address, size_t shard);
+static void
+  s_shard_actor(zsock_t *pipe, void *args);
 
 
-// Here are the constructor and destructor for the broker
+// Here are the constructor and destructor for the broker. The broker takes
+// ownership of the socket it talks to clients and workers over, and uses it
+// for workers too until it is given a backend.
 static broker_t *
-s_broker_new(int verbose)
+s_broker_new(zsock_t *socket, settings_t *settings)
 {
   broker_t *self = (broker_t *)zmalloc(sizeof (broker_t));
 
   //  Initialize broker state
-  self->socket = zsock_new(ZMQ_ROUTER);
-  self->verbose = verbose;
-  self->services = zhash_new();
-  self->workers = zhash_new();
-  self->waiting = zlist_new();
-  self->heartbeat_at = zclock_time() + HEARTBEAT_INTERVAL;
+  self->socket = socket;
+  self->backend = socket;
+  self->verbose = settings->verbose;
+  self->services = s_index_new();
+  self->workers = s_index_new();
+  self->wheel = s_wheel_new(zclock_mono());
+  self->clock = zclock_usecs();
+  self->purge_timer.handler = s_broker_purge_services;
+  self->purge_timer.arg = self;
+  s_wheel_add(self->wheel, &self->purge_timer,
+    s_wheel_time(self->wheel) + HEARTBEAT_INTERVAL);
+  while (self->nbr_peers < settings->nbr_peers) {
+    self->peers[self->nbr_peers] = s_peer_new(self,
+      settings->peers[self->nbr_peers]);
+    self->nbr_peers++;
+  }
+  if (self->nbr_peers) {
+    self->peer_timer.handler = s_broker_poll_peers;
+    self->peer_timer.arg = self;
+    s_wheel_add(self->wheel, &self->peer_timer, s_wheel_time(self->wheel));
+  }
+  self->max_inflight = settings->max_inflight;
+  self->batch = settings->batch;
+  self->queue_max = settings->queue_max;
+  self->queue_bytes_max = settings->queue_bytes_max;
+  self->total_max = settings->total_max;
+  self->total_bytes_max = settings->total_bytes_max;
+  self->overflow = settings->overflow;
+  self->cache_bytes_max = settings->cache_bytes_max;
+  self->max_reissues = settings->max_reissues;
+
+  self->empty = zframe_new("", 0);
+  self->client_header = zframe_from(MDPC_CLIENT);
+  self->worker_header = zframe_from(MDPW_WORKER);
+  for (int command = 1; command < 4; command++) {
+    byte code = (byte)command;
+    self->client_commands[command] = zframe_new(&code, 1);
+  }
+  for (int command = 1; command < 6; command++) {
+    byte code = (byte)command;
+    self->worker_commands[command] = zframe_new(&code, 1);
+  }
   return self;
 }
 
@@ -132,10 +720,33 @@ s_broker_destroy(broker_t **self_p)
   assert(self_p);
   if (*self_p) {
     broker_t *self = *self_p;
+    if (self->backend != self->socket) {
+      zsock_destroy(&self->backend);
+    }
     zsock_destroy(&self->socket);
-    zhash_destroy(&self->services);
-    zhash_destroy(&self->workers);
-    zlist_destroy(&self->waiting);
+    for (size_t index = 0; index < self->nbr_peers; index++) {
+      s_peer_destroy(&self->peers[index]);
+    }
+    for (size_t slot = 0; slot < self->services->limit; slot++) {
+      service_t *service = (service_t *)self->services->slots[slot].item;
+      s_service_destroy(&service);
+    }
+    s_index_destroy(&self->services);
+    for (size_t slot = 0; slot < self->workers->limit; slot++) {
+      worker_t *worker = (worker_t *)self->workers->slots[slot].item;
+      s_worker_destroy(&worker);
+    }
+    s_index_destroy(&self->workers);
+    s_wheel_destroy(&self->wheel);
+    zframe_destroy(&self->empty);
+    zframe_destroy(&self->client_header);
+    zframe_destroy(&self->worker_header);
+    for (int command = 1; command < 4; command++) {
+      zframe_destroy(&self->client_commands[command]);
+    }
+    for (int command = 1; command < 6; command++) {
+      zframe_destroy(&self->worker_commands[command]);
+    }
     free (self);
     *self_p = NULL;
   }
@@ -143,12 +754,34 @@ s_broker_destroy(broker_t **self_p)
 
 // The bind method binds the broker instance to an endpoint. We can call
 // this multiple times. Note that MDP uses a single socket for both clients
-// and workers.
-void
+// and workers. Returns 0 if OK, -1 if the endpoint could not be bound.
+int
 s_broker_bind(broker_t *self, char *endpoint)
 {
-  zsock_bind(self->socket, "%s", endpoint);
+  if (zsock_bind(self->socket, "%s", endpoint) == -1) {
+    zclock_log("E: cannot bind to %s", endpoint);
+    return -1;
+  }
   zclock_log("I: MDP broker/0.2.0 is active at %s", endpoint);
+  return 0;
+}
+
+// The bind_backend method binds an endpoint for workers only, creating the
+// backend socket on first use. After that workers must connect to one of
+// the backend endpoints, and clients to one of the others. An ipc:// or
+// inproc:// backend lets workers on the same host skip TCP loopback.
+int
+s_broker_bind_backend(broker_t *self, char *endpoint, int hwm)
+{
+  if (self->backend == self->socket) {
+    self->backend = s_router_new(hwm);
+  }
+  if (zsock_bind(self->backend, "%s", endpoint) == -1) {
+    zclock_log("E: cannot bind to %s", endpoint);
+    return -1;
+  }
+  zclock_log("I: MDP broker/0.2.0 is active for workers at %s", endpoint);
+  return 0;
 }
 
 // The worker_msg method processes one READY, REPORT, HEARTBEAT or
@@ -160,63 +793,94 @@ s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg)
   assert (zmsg_size (msg) >= 1);     //  At least, command
 
   zframe_t *command = zmsg_pop(msg);
-  char *identity = zframe_strhex(sender);
-  int worker_ready = (zhash_lookup(self->workers, identity) != NULL);
-  free(identity);
-
   worker_t *worker = s_worker_require(self, sender);
 
+  //  Workers stay in the index only once they are attached to a service
+  int worker_ready = (worker->service != NULL);
+
+  //  Any message from a worker tells us it is alive
+  int64_t now = s_wheel_time(self->wheel);
+  worker->expiry = now + HEARTBEAT_EXPIRY;
+
   if (zframe_streq(command, MDPW_READY)) {
+    zframe_t *service_frame = zmsg_pop(msg);
+    zframe_t *props = mdp_props_is(zmsg_first(msg))? zmsg_pop(msg): NULL;
+    service_t *service = NULL;
+
     if (worker_ready) {              //  Not first command in session
       s_worker_delete(worker, 1);
     }
-    else if (zframe_size(sender) >= 4  &&  //  Reserved service name
-      memcmp(zframe_data(sender), "mmi.", 4) == 0) {
+    else if (service_frame == NULL) {
+      s_worker_delete(worker, 1);
+    }
+    else if (zframe_size(service_frame) >= 4  &&  //  Reserved service name
+      memcmp(zframe_data(service_frame), "mmi.", 4) == 0) {
       s_worker_delete(worker, 1);
     }
+    else if ((service = s_service_require(self, service_frame)) == NULL) {
+      s_worker_delete(worker, 1);    //  Service table is full
+    }
     else {
-      //  Attach worker to service and mark as idle
-      zframe_t *service_frame = zmsg_pop(msg);
-      worker->service = s_service_require(self, service_frame);
-
-      zlist_append(self->waiting, worker);
-      zlist_append(worker->service->waiting, worker);
-
+      //  Attach worker to service and mark as idle. It may say how many
+      //  requests it takes at once, and what share it should get; it gets
+      //  one at a time to start with, and one more per report, up to its
+      //  capacity, so a worker that just came up is not flooded.
+      worker->service = service;
       worker->service->workers++;
-      worker->expiry = zclock_time() + HEARTBEAT_EXPIRY;
+      int64_t capacity = mdp_props_get_number(props, MDP_PROPS_CAPACITY,
+        (int64_t) self->max_inflight);
+      int64_t weight = mdp_props_get_number(props, MDP_PROPS_WEIGHT, capacity);
+      worker->capacity = capacity < 1? 1:
+        capacity > WORKER_CAPACITY_MAX? WORKER_CAPACITY_MAX: (size_t) capacity;
+      worker->weight = weight < 1? 1: (size_t) weight;
+      service->groups[worker->hash % KEY_GROUPS].weight += worker->weight;
+      worker->limit = 1;
+      worker->dispatches = (dispatch_t *)zmalloc(
+        worker->capacity * sizeof(dispatch_t));
 
-      s_service_dispatch(worker->service);
+      //  Start the timers; a random phase spreads out the heartbeats of
+      //  workers that all registered at once, as after a broker restart
+      worker->sent_at = now - randof(HEARTBEAT_INTERVAL);
+      s_wheel_add(self->wheel, &worker->expiry_timer, worker->expiry);
+      s_wheel_add(self->wheel, &worker->heartbeat_timer,
+        worker->sent_at + HEARTBEAT_INTERVAL);
 
-      zframe_destroy(&service_frame);
+      s_worker_waiting(worker);
       zclock_log("worker created");
     }
+    zframe_destroy(&service_frame);
+    zframe_destroy(&props);
   }
   else if (zframe_streq(command, MDPW_REPORT)) {
     if (worker_ready) {
-      //  Remove & save client return envelope and insert the
-      //  protocol header and service name, then rewrap envelope.
+      //  Remove client return envelope and pass the body on as it is
       zframe_t *client = zmsg_unwrap(msg);
-      zmsg_pushstr(msg, worker->service->name);
-      zmsg_pushstr(msg, MDPC_REPORT);
-      zmsg_pushstr(msg, MDPC_CLIENT);
-      zmsg_wrap(msg, client);
-      zmsg_send(&msg, self->socket);
+      int completed = s_worker_completed(worker, client);
+      s_service_reply(worker->service, client, MDPC_REPORT, NULL, &msg);
+      zframe_destroy(&client);
+
+      //  A worker that was at its limit has capacity again, and one
+      //  that is still ramping up gets a bit more
+      if (completed) {
+        int full = worker->inflight >= worker->limit;
+        worker->inflight--;
+        if (worker->limit < worker->capacity) {
+          worker->limit++;
+        }
+        if (full) {
+          s_worker_waiting(worker);
+        }
+        else {
+          s_service_reorder(worker->service, worker->slot);
+        }
+      }
     }
     else {
       s_worker_delete(worker, 1);
     }
   }
   else if (zframe_streq(command, MDPW_HEARTBEAT)) {
-    if (worker_ready) {
-      if (zlist_size(self->waiting) > 1) {
-        // Move worker to the end of the waiting queue,
-        // so s_broker_purge will only check old worker(s)
-        zlist_remove(self->waiting, worker);
-        zlist_append(self->waiting, worker);
-      }
-      worker->expiry = zclock_time() + HEARTBEAT_EXPIRY;
-    }
-    else {
+    if (!worker_ready) {
       s_worker_delete(worker, 1);
     }
   }
@@ -226,6 +890,9 @@ s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg)
   else {
     zclock_log("E: invalid input message");
     zmsg_dump(msg);
+    if (!worker_ready) {
+      s_worker_delete(worker, 1);
+    }
   }
 
   zframe_destroy(&command);
@@ -233,432 +900,3298 @@ s_broker_worker_msg(broker_t *self, zframe_t *sender, zmsg_t *msg)
 }
 
 // Process a request coming from a client. We implement MMI requests
-// directly here (at present, we implement only the mmi.service request)
+// directly here: mmi.service, mmi.filter, mmi.coalesce, mmi.cache,
+// mmi.queue, mmi.stats and mmi.services. Requests for services we have
+// no workers for go to a peer broker that has, if there is one.
 
 static void
 s_broker_client_msg(broker_t *self, zframe_t *sender, zmsg_t *msg)
 {
-  assert(zmsg_size(msg) >= 2);     //  Service name + body
+  //  Props are optional, and start with a byte no service name has
+  zframe_t *props = mdp_props_is(zmsg_first(msg))? zmsg_pop(msg): NULL;
 
+  if (zmsg_size(msg) < 2) {         //  Service name + body
+    zclock_log("E: invalid client message");
+    zframe_destroy(&props);
+    zmsg_destroy(&msg);
+    return;
+  }
   zframe_t *service_frame = zmsg_pop(msg);
-  service_t *service = s_service_require(self, service_frame);
+  zframe_t *client = s_token_new(sender, props);
 
   // If we got a MMI service request, process that internally
   if (zframe_size(service_frame) >= 4 &&
     memcmp(zframe_data(service_frame), "mmi.", 4) == 0) {
 
     char *return_code;
+    zframe_t *return_frame = NULL;  //  Frame replaced by the return code
 
     if (zframe_streq(service_frame, "mmi.service")) {
-      char *name = zframe_strdup(zmsg_last (msg));
-      service_t *service = (service_t *)zhash_lookup (self->services, name);
+      service_t *service = s_service_lookup(self, zmsg_last(msg));
       return_code = service && service->workers? "200": "404";
-      free(name);
     }
-    // The filter service that can be used to manipulate
-    // the command filter table.
-    else if (zframe_streq(service_frame, "mmi.filter") && zmsg_size(msg) == 3) {
+    // The queue service reports a service's queue depth in requests and
+    // bytes, how many requests it turned away as busy, and how many it
+    // dropped as their clients had given up on them. Then for each
+    // priority class, from the highest, the requests queued and sent to
+    // workers, and their mean and longest queue time in msecs:
+    // [service] -> [code][requests][bytes][dropped][expired]
+    //              [queued][dispatched][mean wait][max wait]...
+    else if (zframe_streq(service_frame, "mmi.queue")) {
+      service_t *service = s_service_lookup(self, zmsg_last(msg));
+      zmsg_destroy(&msg);
+      msg = zmsg_new();
+      if (service) {
+        zmsg_addstrf(msg, "%zu", service->queued);
+        zmsg_addstrf(msg, "%zu", service->bytes);
+        zmsg_addstrf(msg, "%zu", service->dropped);
+        zmsg_addstrf(msg, "%zu", service->expired);
+        for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+          wait_stats_t *waits = &service->waits[priority];
+          zmsg_addstrf(msg, "%zu", zlist_size(service->requests[priority]));
+          zmsg_addstrf(msg, "%zu", waits->dispatched);
+          zmsg_addstrf(msg, "%" PRId64, waits->dispatched?
+            waits->wait_total / (int64_t) waits->dispatched / 1000: 0);
+          zmsg_addstrf(msg, "%" PRId64, waits->wait_max / 1000);
+        }
+      }
+      zmsg_pushstr(msg, "");
+      return_frame = zmsg_first(msg);
+      return_code = service? "200": "404";
+    }
+    // The stats service reports what we need to size a service's worker
+    // fleet: requests queued, workers with nothing in flight and workers
+    // with something, requests sent to workers and reported back on, NAKs
+    // sent to clients, requests that joined a flight instead of going to
+    // a worker, and requests for cached commands that we answered from
+    // the cache and that we did not, and requests we sent to another
+    // worker as theirs died. Then two histograms, of the time requests
+    // spent queued and the time workers took over them:
+    // [service] -> [code][queued][idle][busy][dispatched][completed][naks]
+    //              [coalesced][hits][misses][reissued]
+    //              [samples][p50][p90][p99][max][buckets]...
+    // Times are in usecs. The buckets frame lists the lowest value and
+    // the count of each bucket that has samples, as "value:count ...".
+    else if (zframe_streq(service_frame, "mmi.stats")) {
+      service_t *service = s_service_lookup(self, zmsg_last(msg));
+      zmsg_destroy(&msg);
+      msg = zmsg_new();
+      if (service) {
+        size_t idle = 0;
+        size_t dispatched = 0;
+        for (size_t slot = 0; slot < service->nbr_waiting; slot++) {
+          if (service->waiting[slot]->inflight == 0) {
+            idle++;
+          }
+        }
+        for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+          dispatched += service->waits[priority].dispatched;
+        }
+        zmsg_addstrf(msg, "%zu", service->queued);
+        zmsg_addstrf(msg, "%zu", idle);
+        zmsg_addstrf(msg, "%zu", service->workers - idle);
+        zmsg_addstrf(msg, "%zu", dispatched);
+        zmsg_addstrf(msg, "%zu", service->completed);
+        zmsg_addstrf(msg, "%zu", service->naks);
+        zmsg_addstrf(msg, "%zu", service->coalesced);
+        zmsg_addstrf(msg, "%zu", service->hits);
+        zmsg_addstrf(msg, "%zu", service->misses);
+        zmsg_addstrf(msg, "%zu", service->reissued);
+        s_histogram_dump(&service->wait_times, msg);
+        s_histogram_dump(&service->service_times, msg);
+      }
+      zmsg_pushstr(msg, "");
+      return_frame = zmsg_first(msg);
+      return_code = service? "200": "404";
+    }
+    // The services service lists the services we have workers for, and
+    // how many requests each has queued, for our peers:
+    // [] -> [code][service][queued][workers]...
+    // A shard lists its own services, and the front joins the lists.
+    else if (zframe_streq(service_frame, "mmi.services")) {
+      zmsg_destroy(&msg);
+      msg = zmsg_new();
+      for (size_t slot = 0; slot < self->services->limit; slot++) {
+        service_t *service = (service_t *)self->services->slots[slot].item;
+        if (service && service->workers) {
+          zframe_t *name = zframe_dup(service->frame);
+          zmsg_append(msg, &name);
+          zmsg_addstrf(msg, "%zu", service->queued);
+          zmsg_addstrf(msg, "%zu", service->workers);
+        }
+      }
+      zmsg_pushstr(msg, "");
+      return_frame = zmsg_first(msg);
+      return_code = "200";
+    }
+    // The filter service that can be used to manipulate the command
+    // filter table: [operation][service][rule]...
+    // The coalesce service takes the same rules, for the commands whose
+    // identical requests share one trip to a worker, while one is queued
+    // or with a worker. There "enable" adds rules and "disable" removes
+    // them.
+    else if ((zframe_streq(service_frame, "mmi.filter")
+          ||  zframe_streq(service_frame, "mmi.coalesce"))
+          &&  zmsg_size(msg) >= 2) {
+      int coalesce = zframe_streq(service_frame, "mmi.coalesce");
       zframe_t *operation = zmsg_pop(msg);
       zframe_t *service_frame = zmsg_pop(msg);
-      zframe_t *command_frame = zmsg_pop(msg);
-      char *command_str = zframe_strdup(command_frame);
 
-      if (zframe_streq(operation, "enable")) {
-        service_t *service = s_service_require(self, service_frame);
-        s_service_enable_command(service, command_str);
-        return_code = "200";
+      service_t *service = s_service_require(self, service_frame);
+
+      if (service == NULL) {
+        return_code = "503";        //  Service table is full
       }
-      else if (zframe_streq(operation, "disable")) {
-        service_t *service = s_service_require(self, service_frame);
-        s_service_disable_command(service, command_str);
-        return_code = "200";
+      else if (coalesce) {
+        return_code = s_filter_update(&service->coalesce, operation, msg,
+          "enable", "disable");
       }
       else {
-        return_code = "400";
+        return_code = s_filter_update(&service->filter, operation, msg,
+          "disable", "enable");
       }
 
       zframe_destroy(&operation);
       zframe_destroy(&service_frame);
-      zframe_destroy(&command_frame);
-      free(command_str);
+      zmsg_destroy(&msg);
       // Add an empty frame; it will be replaced by the return code.
+      msg = zmsg_new();
+      zmsg_pushstr(msg, "");
+    }
+    // The cache service sets which commands have their reports cached,
+    // with the same rules again: [operation][service][ttl][rule]... where
+    // "enable" adds rules and "replace" swaps them in, and the TTL in
+    // msecs then holds for all the service's cached commands; or
+    // [operation][service][rule]... where "disable" removes rules and
+    // "invalidate" drops the reports cached for the commands that match,
+    // or for all commands if there are no rules; or [clear][service].
+    // Changing the rules drops all the service's cached reports.
+    else if (zframe_streq(service_frame, "mmi.cache") && zmsg_size(msg) >= 2) {
+      zframe_t *operation = zmsg_pop(msg);
+      zframe_t *service_frame = zmsg_pop(msg);
+      int with_ttl = zframe_streq(operation, "enable")
+                  || zframe_streq(operation, "replace");
+      char *ttl = with_ttl? zmsg_popstr(msg): NULL;
+
+      service_t *service = s_service_require(self, service_frame);
+
+      if (service == NULL) {
+        return_code = "503";        //  Service table is full
+      }
+      else if (zframe_streq(operation, "invalidate")) {
+        return_code = s_service_invalidate(service, msg);
+      }
+      else if (with_ttl && (ttl == NULL || atol(ttl) <= 0)) {
+        return_code = "400";
+      }
+      else {
+        return_code = s_filter_update(&service->cacheable, operation, msg,
+          "enable", "disable");
+        if (streq(return_code, "200")) {
+          if (with_ttl) {
+            service->cache_ttl = atol(ttl);
+          }
+          s_service_invalidate(service, NULL);
+        }
+      }
+
+      free(ttl);
+      zframe_destroy(&operation);
+      zframe_destroy(&service_frame);
+      zmsg_destroy(&msg);
+      msg = zmsg_new();
       zmsg_pushstr(msg, "");
     }
     else {
       return_code = "501";
     }
 
-    zframe_reset(zmsg_last(msg), return_code, strlen(return_code));
-
-    // Insert the protocol header and service name, then rewrap envelope.
-    zmsg_push(msg, zframe_dup(service_frame));
-    zmsg_pushstr(msg, MDPC_REPORT);
-    zmsg_pushstr(msg, MDPC_CLIENT);
-    zmsg_wrap(msg, zframe_dup(sender));
-    zmsg_send(&msg, self->socket);
-  }
-  else {
-    int enabled = 1;
-
-    if (zmsg_size(msg) >= 1) {
-      zframe_t *cmd_frame = zmsg_first(msg);
-      char *cmd = zframe_strdup(cmd_frame);
-      enabled = s_service_is_command_enabled(service, cmd);
-      free(cmd);
+    if (return_frame == NULL) {
+      return_frame = zmsg_last(msg);
     }
+    zframe_reset(return_frame, return_code, strlen(return_code));
+    s_broker_client_send(self, client, MDPC_REPORT, NULL, service_frame, &msg);
+  }
+  else if (!s_broker_forward(self, client, props, service_frame, &msg)) {
+    service_t *service = s_service_require(self, service_frame);
 
     // Forward the message to the worker.
-    if (enabled) {
-      zmsg_wrap(msg, zframe_dup (sender));
-      zlist_append(service->requests, msg);
+    if (service && (zmsg_size(msg) == 0 ||
+        s_service_is_command_enabled(service, zmsg_first(msg)))) {
+      s_service_enqueue(service, &client, props, &msg);
       s_service_dispatch(service);
     }
-    // Send a NAK message back to the client.
+    // Send a NAK message back to the client. We also get here when
+    // the service is unknown and the service table is full.
     else {
-      zmsg_push(msg, zframe_dup(service_frame));
-      zmsg_pushstr(msg, MDPC_NAK);
-      zmsg_pushstr(msg, MDPC_CLIENT);
-      zmsg_wrap(msg, zframe_dup(sender));
-      zmsg_send(&msg, self->socket);
+      if (service) {
+        service->naks++;
+      }
+      s_broker_client_send(self, client, MDPC_NAK,
+        service? NAK_FORBIDDEN: NAK_BUSY, service_frame, &msg);
     }
   }
 
+  zframe_destroy(&client);
   zframe_destroy(&service_frame);
+  zframe_destroy(&props);
 }
 
-// The purge method deletes any idle workers that haven't pinged us in a
-// while. We hold workers from oldest to most recent, so we can stop
-// scanning whenever we find a live worker. This means we'll mainly stop
-// at the first worker, which is essential when we have large numbers of
-// workers (since we call this method in our critical path)
+// The client_send method sends a REPORT or NAK to a client. It takes
+// ownership of the message body, which is passed on without copying;
+// the envelope is stacked from constant frames in front of it. A NAK
+// carries a status code in front of the body of the request. The client
+// is given by its token, which holds its address and any props to echo.
 static void
-s_broker_purge(broker_t *self)
+s_broker_client_send(broker_t *self, zframe_t *client, char *command,
+  char *status, zframe_t *service_frame, zmsg_t **msg_p)
 {
-  worker_t *worker = (worker_t *)zlist_first(self->waiting);
-
-  while (worker) {
-    if (zclock_time() < worker->expiry) {
-      break;          //  Worker is alive, we're done here
-    }
-
-    if (self->verbose) {
-      zclock_log("I: deleting expired worker: %s", worker->identity);
-    }
+  assert(msg_p && *msg_p);
+  zmsg_t *msg = *msg_p;
 
-    s_worker_delete(worker, 0);
-    worker = (worker_t *)zlist_first(self->waiting);
+  byte *token = zframe_data(client);
+  size_t token_size = zframe_size(client);
+  if (token_size < 1 || (size_t) token[0] + 9 > token_size) {
+    zclock_log("E: invalid client token");
+    zmsg_destroy(msg_p);
+    return;
   }
-}
-
-// Here is the implementation of the methods that work on a service.
-// Lazy constructor that locates a service by name, or creates a new
-// service if there is no service already with that name.
-static service_t *
-s_service_require(broker_t *self, zframe_t *service_frame)
-{
-  assert(service_frame);
-  char *name = zframe_strdup(service_frame);
+  size_t address_size = token[0];
+  size_t echo_size = token_size - address_size - 9;
 
-  service_t *service =  (service_t *)zhash_lookup(self->services, name);
+  if (status) {
+    zmsg_pushstr(msg, status);
+  }
 
-  if (service == NULL) {
-    service = (service_t *)zmalloc(sizeof(service_t));
-    service->broker = self;
-    service->name = name;
-    service->requests = zlist_new();
-    service->waiting = zlist_new();
-    service->blacklist = zlist_new();
+  if (self->verbose) {
+    zclock_log("I: sending %s to client",
+      *command == *MDPC_NAK? "NAK": "REPORT");
+    zmsg_dump(msg);
+  }
 
-    zhash_insert(self->services, name, service);
-    zhash_freefn(self->services, name, s_service_destroy);
+  int more = zmsg_size(msg) > 0? ZFRAME_MORE: 0;
+  void *handle = zsock_resolve(self->socket);
+  zmq_send(handle, token + 1, address_size, ZMQ_SNDMORE);
+  s_send_frame(self->socket, self->empty, ZFRAME_MORE);
+  s_send_frame(self->socket, self->client_header, ZFRAME_MORE);
+  s_send_frame(self->socket, self->client_commands[(int) *command],
+    ZFRAME_MORE);
+  if (echo_size) {
+    zmq_send(handle, token + 9 + address_size, echo_size, ZMQ_SNDMORE);
+  }
+  s_send_frame(self->socket, service_frame, more);
 
-    if (self->verbose) {
-      zclock_log("I: added service: %s", name);
-    }
+  if (more) {
+    zmsg_send(msg_p, self->socket);
   }
   else {
-    free(name);
+    zmsg_destroy(msg_p);
   }
-
-  return service;
 }
 
-// Service destructor is called automatically whenever the service is
-// removed from broker->services.
-static void
-s_service_destroy(void *argument)
+// A token is what we give a worker in place of the client's address, and
+// what the worker hands back with its report: the size of the address,
+// the address, the id of the flight the request leads or zero, the id of
+// the request's dispatch to the worker, and the props we must echo to the
+// client, if any: the tag of a peer broker, and the id a client gave the
+// request so it can have several in flight.
+static zframe_t *
+s_token_new(zframe_t *sender, zframe_t *props)
 {
-  service_t *service = (service_t *) argument;
-  while (zlist_size(service->requests)) {
-    zmsg_t *msg = (zmsg_t*)zlist_pop(service->requests);
-    zmsg_destroy(&msg);
+  mdp_props_t echo;
+  mdp_props_init(&echo);
+  size_t tag_size;
+  const byte *tag = mdp_props_get(props, MDP_PROPS_TAG, &tag_size);
+  if (tag) {
+    mdp_props_put(&echo, MDP_PROPS_TAG, tag, tag_size);
   }
-  //  Free memory keeping  blacklisted commands.
-  char *command = (char *)zlist_first(service->blacklist);
-  while (command) {
-    zlist_remove(service->blacklist, command);
-    free(command);
+  size_t id_size;
+  const byte *id = mdp_props_get(props, MDP_PROPS_REQUEST, &id_size);
+  if (id) {
+    mdp_props_put(&echo, MDP_PROPS_REQUEST, id, id_size);
   }
-  zlist_destroy(&service->requests);
-  zlist_destroy(&service->waiting);
-  zlist_destroy(&service->blacklist);
-  free(service->name);
-  free(service);
+  size_t address_size = zframe_size(sender);
+  size_t echo_size = echo.size > 1? echo.size: 0;
+
+  zframe_t *token = zframe_new(NULL, 9 + address_size + echo_size);
+  byte *data = zframe_data(token);
+  data[0] = (byte) address_size;
+  memcpy(data + 1, zframe_data(sender), address_size);
+  memset(data + 1 + address_size, 0, 8);
+  memcpy(data + 9 + address_size, echo.data, echo_size);
+  return token;
 }
 
-// The dispatch method sends request to the worker.
-static void
-s_service_dispatch(service_t *self)
+// Returns the id held at an offset past the address in a token, or 0 if
+// the token is too short to hold one
+static uint32_t
+s_token_get(zframe_t *token, size_t offset)
 {
-  assert(self);
-
-  s_broker_purge(self->broker);
-  if (zlist_size(self->waiting) == 0) {
-    return;
+  byte *data = zframe_data(token);
+  if (zframe_size(token) < 1 || (size_t) data[0] + 9 > zframe_size(token)) {
+    return 0;
   }
+  byte *id = data + 1 + data[0] + offset;
+  return ((uint32_t) id[0] << 24) | ((uint32_t) id[1] << 16)
+       | ((uint32_t) id[2] << 8) | (uint32_t) id[3];
+}
 
-  while (zlist_size(self->requests) > 0) {
-    worker_t *worker = (worker_t*)zlist_pop(self->waiting);
-
-    zlist_remove(self->waiting, worker);
-    zmsg_t *msg = (zmsg_t*)zlist_pop(self->requests);
-    s_worker_send(worker, MDPW_REQUEST, NULL, msg);
+// Returns the flight id held in a token, or 0 if it has none
+static uint32_t
+s_token_flight(zframe_t *token)
+{
+  return s_token_get(token, 0);
+}
 
-    // Workers are scheduled in the round-robin fashion
-    zlist_append(self->waiting, worker);
-    zmsg_destroy(&msg);
-  }
+// Returns the dispatch id held in a token, or 0 if it has none
+static uint32_t
+s_token_dispatch(zframe_t *token)
+{
+  return s_token_get(token, 4);
 }
 
+// Marks a token with the id of the request's dispatch to a worker
 static void
-s_service_enable_command(service_t *self, const char *command)
+s_token_set_dispatch(zframe_t *token, uint32_t id)
 {
-  char *item = (char *)zlist_first(self->blacklist);
+  byte *data = zframe_data(token);
+  byte *next = data + 5 + data[0];
+  next[0] = (byte) (id >> 24);
+  next[1] = (byte) (id >> 16);
+  next[2] = (byte) (id >> 8);
+  next[3] = (byte) id;
+}
 
-  while (item && !streq(item, command)) {
-    item = (char *)zlist_next(self->blacklist);
+// The forward method sends a request for a service we have no workers for
+// to a peer that has. We pick the peer with the fewest requests queued per
+// worker, counting those we sent it since it last told us. Requests from
+// peers, and commands we have disabled, are not forwarded. Returns 1 if a
+// peer took the request, else 0.
+static int
+s_broker_forward(broker_t *self, zframe_t *client, zframe_t *props,
+  zframe_t *service_frame, zmsg_t **msg_p)
+{
+  if (self->nbr_peers == 0 || mdp_props_get(props, MDP_PROPS_TAG, NULL)) {
+    return 0;
   }
-
-  if (item) {
-    zlist_remove(self->blacklist, item);
-    free(item);
+  service_t *service = s_service_lookup(self, service_frame);
+  if (service && (service->workers || (zmsg_size(*msg_p) > 0
+  &&  !s_service_is_command_enabled(service, zmsg_first(*msg_p))))) {
+    return 0;
   }
-}
+  uint32_t hash = s_index_hash(zframe_data(service_frame),
+    zframe_size(service_frame));
+  int64_t now = s_wheel_time(self->wheel);
+  peer_t *peer = NULL;
+  advert_t *best = NULL;
 
-static void
-s_service_disable_command(service_t *self, const char *command)
+  for (size_t index = 0; index < self->nbr_peers; index++) {
+    advert_t *advert = (advert_t *)s_index_lookup(self->peers[index]->services,
+      zframe_data(service_frame), zframe_size(service_frame), hash);
+    if (advert == NULL || advert->workers == 0 || advert->expiry < now) {
+      continue;
+    }
+    if (best == NULL || (advert->queued + advert->forwarded) * best->workers
+                      < (best->queued + best->forwarded) * advert->workers) {
+      best = advert;
+      peer = self->peers[index];
+    }
+  }
+  if (best == NULL
+  ||  s_peer_forward(peer, client, props, service_frame, msg_p)) {
+    return 0;
+  }
+  best->forwarded++;
+  return 1;
+}
+
+// Sends one frame of an envelope, leaving the caller's frame intact.
+// Small frames are copied inline by libzmq, so this does not allocate.
+static void
+s_send_frame(zsock_t *socket, zframe_t *frame, int flags)
+{
+  zframe_send(&frame, socket, ZFRAME_REUSE | flags);
+}
+
+// Reads a message if one is waiting, else returns NULL at once. The run
+// loops drain their sockets this way rather than with a receive timeout,
+// as a shard's socket is its actor pipe, and zactor_destroy relies on the
+// pipe blocking to wait for the shard to finish.
+static zmsg_t *
+s_recv_nowait(zsock_t *socket)
 {
-  char *item = (char *)zlist_first(self->blacklist);
+  if (!(zsock_events(socket) & ZMQ_POLLIN)) {
+    return NULL;
+  }
+  return zmsg_recv(socket);
+}
 
-  while (item && !streq(item, command)) {
-    item = (char *) zlist_next(self->blacklist);
+// Creates a ROUTER socket for clients or workers
+static zsock_t *
+s_router_new(int hwm)
+{
+  zsock_t *socket = zsock_new(ZMQ_ROUTER);
+  if (hwm > 0) {
+    zsock_set_sndhwm(socket, hwm);
+    zsock_set_rcvhwm(socket, hwm);
   }
+  return socket;
+}
 
-  if (!item) {
-    zlist_push(self->blacklist, strdup(command));
+// Asks each peer which services it has workers for, once per heartbeat
+// interval. A peer that has gone away just stops answering, and its
+// adverts go stale.
+static void
+s_broker_poll_peers(wheel_timer_t *timer, void *arg)
+{
+  broker_t *self = (broker_t *)arg;
+  for (size_t index = 0; index < self->nbr_peers; index++) {
+    zsock_t *socket = self->peers[index]->socket;
+    if (zsock_events(socket) & ZMQ_POLLOUT) {
+      s_send_frame(socket, self->empty, ZFRAME_MORE);
+      s_send_frame(socket, self->client_header, ZFRAME_MORE);
+      zstr_sendm(socket, "mmi.services");
+      zstr_send(socket, "");
+    }
   }
+  s_wheel_add(self->wheel, timer,
+    s_wheel_time(self->wheel) + HEARTBEAT_INTERVAL);
 }
 
+// Reads one command from the actor pipe of an embedded broker. Returns 1
+// if we were told to terminate, else 0.
 static int
-s_service_is_command_enabled(service_t *self, const char *command)
+s_pipe_terminated(zsock_t *pipe)
+{
+  zmsg_t *msg = zmsg_recv(pipe);
+  int terminated = (msg == NULL
+    || (zmsg_size(msg) == 1 && zframe_streq(zmsg_first(msg), "$TERM")));
+  zmsg_destroy(&msg);
+  return terminated;
+}
+
+// The purge_services method deletes services that have had no workers for
+// SERVICE_EXPIRY msecs, so that names made up by clients do not live
+// forever. Services with disabled, coalesced or cached commands are kept,
+// as an operator set those up on purpose. It runs from a timer, once per
+// heartbeat interval.
+static void
+s_broker_purge_services(wheel_timer_t *timer, void *arg)
 {
-  char *item = (char *)zlist_first(self->blacklist);
+  broker_t *self = (broker_t *)arg;
+  zlist_t *expired = zlist_new();
+  int64_t now = s_wheel_time(self->wheel);
+
+  for (size_t slot = 0; slot < self->services->limit; slot++) {
+    service_t *service = (service_t *)self->services->slots[slot].item;
+    if (service && service->workers == 0 && now >= service->expiry
+    &&  service->filter == NULL && service->coalesce == NULL
+    &&  service->cacheable == NULL) {
+      zlist_append(expired, service);
+    }
+  }
 
-  while (item && !streq(item, command)) {
-    item = (char *)zlist_next(self->blacklist);
+  service_t *service = (service_t *)zlist_pop(expired);
+  while (service) {
+    if (self->verbose) {
+      zclock_log("I: deleting expired service: %s", service->name);
+    }
+    s_service_delete(service);
+    service = (service_t *)zlist_pop(expired);
   }
+  zlist_destroy(&expired);
 
-  return item? 0 : 1;
+  s_wheel_add(self->wheel, timer, now + HEARTBEAT_INTERVAL);
 }
 
-// Here is the implementation of the methods that work on a worker.
-// Lazy constructor that locates a worker by identity, or creates a new
-// worker if there is no worker already with that identity.
-static worker_t *
-s_worker_require(broker_t *self, zframe_t *address)
+// The run method gets and processes messages forever, or until it is
+// interrupted or, when running as a shard or embedded, told to terminate.
+// Each wakeup reads up to a batch of messages from each socket without
+// blocking, so under load we poll and run timers once per batch rather
+// than once per message. Replies from peers come in on a socket per peer.
+static void
+s_broker_run(broker_t *self)
 {
-  assert(address);
+  zmq_pollitem_t items[3 + PEER_MAX];
+  int nbr_items = 0;
+  int backend = 0;
+  int pipe = 0;
+  items[nbr_items++] = (zmq_pollitem_t) {
+    zsock_resolve(self->socket), 0, ZMQ_POLLIN, 0
+  };
+  if (self->backend != self->socket) {
+    backend = nbr_items;
+    items[nbr_items++] = (zmq_pollitem_t) {
+      zsock_resolve(self->backend), 0, ZMQ_POLLIN, 0
+    };
+  }
+  if (self->pipe) {
+    pipe = nbr_items;
+    items[nbr_items++] = (zmq_pollitem_t) {
+      zsock_resolve(self->pipe), 0, ZMQ_POLLIN, 0
+    };
+  }
+  int peers = nbr_items;
+  for (size_t index = 0; index < self->nbr_peers; index++) {
+    items[nbr_items++] = (zmq_pollitem_t) {
+      zsock_resolve(self->peers[index]->socket), 0, ZMQ_POLLIN, 0
+    };
+  }
+  int terminated = 0;
 
-  // self->workers is keyed off worker identity
-  char *identity = zframe_strhex(address);
-  worker_t *worker = (worker_t *)zhash_lookup(self->workers, identity);
+  while (!terminated) {
+    int rc = zmq_poll(items, nbr_items,
+      s_wheel_timeout(self->wheel) * ZMQ_POLL_MSEC);
+    if (rc == -1) {
+      break;            // Interrupted
+    }
 
-  if (worker == NULL) {
-    worker = (worker_t *)zmalloc(sizeof(worker_t));
-    worker->broker = self;
-    worker->identity = identity;
-    worker->address = zframe_dup(address);
+    // Run any timers that are due: heartbeats, worker and service expiry
+    s_wheel_advance(self->wheel, zclock_mono());
+    self->clock = zclock_usecs();
 
-    zhash_insert(self->workers, identity, worker);
-    zhash_freefn(self->workers, identity, s_worker_destroy);
+    // Process the waiting input messages, if any; workers first, so that
+    // their capacity is there for the requests
+    if (backend && (items[backend].revents & ZMQ_POLLIN)) {
+      s_broker_drain(self, self->backend);
+    }
+    for (size_t index = 0; index < self->nbr_peers; index++) {
+      if (items[peers + index].revents & ZMQ_POLLIN) {
+        s_peer_drain(self->peers[index]);
+      }
+    }
+    if (items[0].revents & ZMQ_POLLIN) {
+      terminated = s_broker_drain(self, self->socket);
+    }
+    if (pipe && (items[pipe].revents & ZMQ_POLLIN)) {
+      terminated = s_pipe_terminated(self->pipe);
+    }
+  }
+}
 
-    if (self->verbose) {
-      zclock_log ("I: registering new worker: %s", identity);
+// The drain method processes up to a batch of messages from one socket.
+// Returns 1 if a shard was told to terminate, else 0.
+static int
+s_broker_drain(broker_t *self, zsock_t *socket)
+{
+  for (size_t count = 0; count < self->batch; count++) {
+    zmsg_t *msg = s_recv_nowait(socket);
+    if (!msg) {
+      break;            // Drained, or interrupted
+    }
+    //  A shard is told to stop by its actor pipe
+    if (zmsg_size(msg) == 1 && zframe_streq(zmsg_first(msg), "$TERM")) {
+      zmsg_destroy(&msg);
+      return 1;
     }
+    s_broker_process(self, socket, msg);
   }
-  else {
-    free(identity);
+  return 0;
+}
+
+// The process method handles one message from a client or worker. With a
+// separate backend, clients and workers must each use their own socket, as
+// our replies to them go out on that socket.
+static void
+s_broker_process(broker_t *self, zsock_t *socket, zmsg_t *msg)
+{
+  if (self->verbose) {
+    zclock_log("I: received message:");
+    zmsg_dump(msg);
   }
+  zframe_t *sender = zmsg_pop(msg);
+  zframe_t *empty  = zmsg_pop(msg);
+  zframe_t *header = zmsg_pop(msg);
 
-  return worker;
+  if (zframe_streq(header, MDPC_CLIENT) && socket == self->socket) {
+    s_broker_client_msg(self, sender, msg);
+  }
+  else if (zframe_streq(header, MDPW_WORKER) && socket == self->backend) {
+    s_broker_worker_msg(self, sender, msg);
+  }
+  else {
+    zclock_log("E: invalid message:");
+    zmsg_dump(msg);
+    zmsg_destroy(&msg);
+  }
+  zframe_destroy(&sender);
+  zframe_destroy(&empty);
+  zframe_destroy(&header);
 }
 
-//  The delete method deletes the current worker.
+// Request destructor; the message may already have been sent on.
 static void
-s_worker_delete(worker_t *self, int disconnect)
+s_request_destroy(request_t **self_p)
 {
-  assert(self);
+  assert(self_p);
+  if (*self_p) {
+    request_t *self = *self_p;
+    zmsg_destroy(&self->msg);
+    free(self);
+    *self_p = NULL;
+  }
+}
 
-  if (disconnect) {
-    s_worker_send(self, MDPW_DISCONNECT, NULL, NULL);
+// Here is the implementation of the methods that work on a service.
+// The lookup method locates a service by the name held in a frame, without
+// allocating. The few most recently used services are compared directly
+// against the frame before we fall back to hashing it.
+static service_t *
+s_service_lookup(broker_t *self, zframe_t *service_frame)
+{
+  assert(service_frame);
+  byte *name = zframe_data(service_frame);
+  size_t size = zframe_size(service_frame);
+
+  for (int entry = 0; entry < SERVICE_CACHE_SIZE; entry++) {
+    service_t *service = (service_t *)self->recent[entry];
+    if (service && zframe_size(service->frame) == size
+    &&  memcmp(zframe_data(service->frame), name, size) == 0) {
+      return service;
+    }
+  }
+
+  uint32_t hash = s_index_hash(name, size);
+  service_t *service =
+    (service_t *)s_index_lookup(self->services, name, size, hash);
+  if (service) {
+    self->recent[self->recent_next] = service;
+    self->recent_next = (self->recent_next + 1) % SERVICE_CACHE_SIZE;
   }
+  return service;
+}
+
+// Lazy constructor that locates a service by name, or creates a new
+// service if there is no service already with that name. Returns NULL
+// if the service is new and the broker already holds SERVICE_MAX services.
+static service_t *
+s_service_require(broker_t *self, zframe_t *service_frame)
+{
+  service_t *service = s_service_lookup(self, service_frame);
+
+  if (service == NULL) {
+    if (self->services->size >= SERVICE_MAX) {
+      zclock_log("W: service table is full, rejecting new service");
+      return NULL;
+    }
+    service = (service_t *)zmalloc(sizeof(service_t));
+    service->broker = self;
+    service->name = zframe_strdup(service_frame);
+    service->frame = zframe_dup(service_frame);
+    service->hash = s_index_hash(zframe_data(service->frame),
+      zframe_size(service->frame));
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+      service->requests[priority] = zlist_new();
+    }
+    service->expiry = s_wheel_time(self->wheel) + SERVICE_EXPIRY;
 
-  if (self->service) {
-    zlist_remove(self->service->waiting, self);
-    self->service->workers--;
+    s_index_insert(self->services, zframe_data(service->frame),
+      zframe_size(service->frame), service->hash, service);
+
+    if (self->verbose) {
+      zclock_log("I: added service: %s", service->name);
+    }
   }
 
-  zlist_remove(self->broker->waiting, self);
-  //  This implicitly calls s_worker_destroy
-  zhash_delete(self->broker->workers, self->identity);
+  return service;
 }
 
-// Worker destructor is called automatically whenever the worker is
-// removed from broker->workers.
+// The delete method removes a service from the broker. Requests still
+// queued for it are NAKed, so their clients need not wait for a timeout.
 static void
-s_worker_destroy (void *argument)
+s_service_delete(service_t *self)
 {
-  worker_t *self = (worker_t *)argument;
-  zframe_destroy(&self->address);
-  free(self->identity);
-  free(self);
+  broker_t *broker = self->broker;
+  assert(self->workers == 0);
+
+  request_t *request = s_service_dequeue(self);
+  while (request) {
+    zframe_t *client = zmsg_unwrap(request->msg);
+    s_service_reply(self, client, MDPC_NAK, NAK_NOT_FOUND, &request->msg);
+    zframe_destroy(&client);
+    s_request_destroy(&request);
+    request = s_service_dequeue(self);
+  }
+
+  for (int entry = 0; entry < SERVICE_CACHE_SIZE; entry++) {
+    if (broker->recent[entry] == self) {
+      broker->recent[entry] = NULL;
+    }
+  }
+  s_index_delete(broker->services, self, self->hash);
+  s_service_destroy(&self);
 }
 
-// The send method formats and sends a command to a worker. The caller may
-// also provide a command option, and a message payload.
-static char *mdpw_commands [] = {
-  NULL, "READY", "REQUEST", "REPORT", "HEARTBEAT", "DISCONNECT"
-};
+// Service destructor, called once the service has left broker->services.
+static void
+s_service_destroy(service_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    service_t *self = *self_p;
+    for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+      while (zlist_size(self->requests[priority])) {
+        request_t *request = (request_t *)zlist_pop(self->requests[priority]);
+        s_request_destroy(&request);
+      }
+      zlist_destroy(&self->requests[priority]);
+    }
+    s_filter_destroy(&self->filter);
+    s_filter_destroy(&self->coalesce);
+    if (self->flights) {
+      for (size_t slot = 0; slot < self->flights->limit; slot++) {
+        flight_t *flight = (flight_t *)self->flights->slots[slot].item;
+        s_flight_destroy(&flight);
+      }
+      s_index_destroy(&self->flights);
+      s_index_destroy(&self->flight_ids);
+    }
+    s_filter_destroy(&self->cacheable);
+    if (self->cache) {
+      for (size_t slot = 0; slot < self->cache->limit; slot++) {
+        cache_entry_t *entry = (cache_entry_t *)self->cache->slots[slot].item;
+        s_cache_entry_destroy(&entry);
+      }
+      s_index_destroy(&self->cache);
+    }
+    for (size_t index = 0; index < KEY_GROUPS; index++) {
+      free(self->groups[index].waiting);
+    }
+    free(self->waiting);
+    zframe_destroy(&self->frame);
+    free(self->name);
+    free(self);
+    *self_p = NULL;
+  }
+}
 
+// The enqueue method queues a client request for the service, within the
+// broker's limits on queued requests and bytes. A request that does not
+// fit is refused as busy, or dropped, as the overflow policy says. With
+// OVERFLOW_DROP_OLDEST we make room by refusing older requests for this
+// service, lowest priority first; other services' requests are left alone.
+// The client's props give the request's priority class, its budget, after
+// which the client gives up on it, and which body frame, if any, holds
+// its affinity key.
+// A request the service coalesces joins a flight with the same body, if
+// there is one, and is not queued at all; nor is one we answer from the
+// cache.
 static void
-s_worker_send(worker_t *self, char *command, char *option, zmsg_t *msg)
+s_service_enqueue(service_t *self, zframe_t **client_p, zframe_t *props,
+  zmsg_t **msg_p)
 {
-  msg = msg? zmsg_dup(msg) : zmsg_new();
+  broker_t *broker = self->broker;
+  size_t size = zmsg_content_size(*msg_p) + zframe_size(*client_p);
+  int64_t now = s_wheel_time(broker->wheel);
+  int64_t budget = mdp_props_get_number(props, MDP_PROPS_BUDGET, -1);
+  int64_t deadline = budget >= 0? now + budget: 0;
 
-  //  Stack protocol envelope to start of message
-  if (option) {
-    zmsg_pushstr(msg, option);
+  if (s_service_join(self, *client_p, deadline, msg_p)) {
+    *client_p = NULL;
+    return;
+  }
+  while (s_service_is_full(self, size)) {
+    self->dropped++;
+    if (broker->overflow == OVERFLOW_DROP_NEWEST) {
+      if (broker->verbose) {
+        zclock_log("W: %s queue is full, dropping request", self->name);
+      }
+      flight_t *flight = s_service_land(self, s_token_flight(*client_p));
+      s_flight_destroy(&flight);
+      zmsg_destroy(msg_p);
+      return;
+    }
+    self->naks++;
+    if (broker->overflow == OVERFLOW_NAK || self->queued == 0) {
+      s_service_reply(self, *client_p, MDPC_NAK, NAK_BUSY, msg_p);
+      return;
+    }
+    request_t *oldest = s_service_evict(self);
+    zframe_t *client = zmsg_unwrap(oldest->msg);
+    s_service_reply(self, client, MDPC_NAK, NAK_BUSY, &oldest->msg);
+    zframe_destroy(&client);
+    s_request_destroy(&oldest);
   }
-  zmsg_pushstr(msg, command);
-  zmsg_pushstr(msg, MDPW_WORKER);
 
-  //  Stack routing envelope to start of message
-  zmsg_wrap(msg, zframe_dup(self->address));
+  int64_t priority = mdp_props_get_number(props, MDP_PROPS_PRIORITY,
+    PRIORITY_DEFAULT);
 
-  if (self->broker->verbose) {
-    zclock_log("I: sending %s to worker", mdpw_commands [(int) *command]);
-    zmsg_dump(msg);
+  request_t *request = (request_t *)zmalloc(sizeof(request_t));
+  request->msg = *msg_p;
+  request->size = size;
+  request->deadline = deadline;
+  request->queued_at = broker->clock;
+  request->priority = priority < PRIORITY_CLASSES?
+    (int) priority: PRIORITY_CLASSES - 1;
+  int64_t key_frame = mdp_props_get_number(props, MDP_PROPS_KEY, -1);
+  if (key_frame >= 0 && key_frame < (int64_t) zmsg_size(*msg_p)) {
+    zframe_t *frame = zmsg_first(*msg_p);
+    while (key_frame--) {
+      frame = zmsg_next(*msg_p);
+    }
+    request->keyed = 1;
+    request->key = s_index_hash(zframe_data(frame), zframe_size(frame));
   }
-
-  zmsg_send(&msg, self->broker->socket);
+  zmsg_wrap(request->msg, *client_p);
+  *client_p = NULL;
+  zlist_append(self->requests[request->priority], request);
+  *msg_p = NULL;
+  self->queued++;
+  self->bytes += size;
+  broker->queued++;
+  broker->queued_bytes += size;
 }
 
-
-// Finally here is the main task. We create a new broker instance and
-// then processes messages on the broker socket.
-int main(int argc, char *argv[])
+// Takes the next request off the queues, or returns NULL if they are empty.
+// The class is picked by smooth weighted round robin: every class with
+// requests earns its weight in credit, and the richest class pays for the
+// dispatch with the weight of all the classes that took part.
+static request_t *
+s_service_dequeue(service_t *self)
 {
-  int verbose = 0;
-  int daemonize = 0;
-  int user_endpoint = 0;
+  int best = -1;
+  int total = 0;
 
-  for (int i = 1; i < argc; i++) {
-    if (streq(argv[i], "-v")) {
-      verbose = 1;
-    }
-    else if (streq(argv[i], "-d")) {
-      daemonize = 1;
+  for (int priority = 0; priority < PRIORITY_CLASSES; priority++) {
+    if (zlist_size(self->requests[priority])) {
+      self->credit[priority] += s_priority_weights[priority];
+      total += s_priority_weights[priority];
+      if (best < 0 || self->credit[priority] > self->credit[best]) {
+        best = priority;
+      }
     }
-    else if (streq(argv[i], "-h")) {
-      printf("%s [-h] | [-d] [-v] [broker url]\n\t-h This help message\n\t-d Daemon mode.\n\t-v Verbose output\n\tbroker url defaults to tcp://*:5555\n", argv[0]);
-      return -1;
+    else {
+      self->credit[priority] = 0;   //  No saving up while idle
     }
-    else user_endpoint = 1;
   }
-
-  if (daemonize != 0) {
-    int rc = daemon(0, 0);
-    assert(rc == 0);
+  if (best < 0) {
+    return NULL;
   }
+  self->credit[best] -= total;
 
-  broker_t *self = s_broker_new(verbose);
-  /* did the user specify a bind address? */
-  if (user_endpoint == 1) {
-    s_broker_bind(self, argv[argc-1]);
-    printf("Bound to %s\n", argv[argc-1]);
-  }
-  else {
-    /* default */
-    s_broker_bind(self, "tcp://*:5555");
-    printf("Bound to tcp://*:5555\n");
+  request_t *request = (request_t *)zlist_pop(self->requests[best]);
+  s_service_unqueue(self, request);
+  return request;
+}
+
+// Takes the oldest request of the lowest priority class off the queues,
+// to make room for a new one
+static request_t *
+s_service_evict(service_t *self)
+{
+  for (int priority = PRIORITY_CLASSES - 1; priority >= 0; priority--) {
+    request_t *request = (request_t *)zlist_pop(self->requests[priority]);
+    if (request) {
+      s_service_unqueue(self, request);
+      return request;
+    }
   }
+  return NULL;
+}
 
-  // Get and process messages forever or until interrupted
-  while (true) {
-    zmq_pollitem_t items[] = { {zsock_resolve(self->socket),  0, ZMQ_POLLIN, 0} };
+// Accounts for a request that has left the queues
+static void
+s_service_unqueue(service_t *self, request_t *request)
+{
+  self->queued--;
+  self->bytes -= request->size;
+  self->broker->queued--;
+  self->broker->queued_bytes -= request->size;
+}
 
-    int rc = zmq_poll(items, 1, HEARTBEAT_INTERVAL*ZMQ_POLL_MSEC);
-    if (rc == -1) {
-      break;            // Interrupted
+// Puts a request back at the head of its class, as it already waited its
+// turn. It takes no notice of the queue limits, as it was let in once.
+static void
+s_service_requeue(service_t *self, request_t *request)
+{
+  request->queued_at = self->broker->clock;
+  zlist_push(self->requests[request->priority], request);
+  self->queued++;
+  self->bytes += request->size;
+  self->broker->queued++;
+  self->broker->queued_bytes += request->size;
+}
+
+// Checks whether a request of the given size would take the service or
+// the broker over any of its queue limits
+static int
+s_service_is_full(service_t *self, size_t size)
+{
+  broker_t *broker = self->broker;
+  return (broker->queue_max && self->queued >= broker->queue_max)
+      || (broker->queue_bytes_max
+          && self->bytes + size > broker->queue_bytes_max)
+      || (broker->total_max && broker->queued >= broker->total_max)
+      || (broker->total_bytes_max
+          && broker->queued_bytes + size > broker->total_bytes_max);
+}
+
+// The dispatch method sends requests to the least loaded workers. A worker
+// that reaches the concurrency limit leaves the waiting heap until it
+// reports back, so requests never pile up behind a busy worker. Requests
+// whose clients have already given up are dropped here, and the worker
+// is told how long the client of each request will still wait.
+static void
+s_service_dispatch(service_t *self)
+{
+  assert(self);
+  int64_t now = s_wheel_time(self->broker->wheel);
+
+  while (self->queued > 0) {
+    if (self->nbr_waiting == 0) {
+      break;            //  Every worker is busy
     }
 
-    // Process next input message, if any
-    if (items[0].revents & ZMQ_POLLIN) {
-      zmsg_t *msg = zmsg_recv(self->socket);
-      if (!msg) {
-        break;          // Interrupted
+    request_t *request = s_service_dequeue(self);
+    if (request->deadline && now >= request->deadline) {
+      //  Nobody will read a NAK; a late one would only confuse the client.
+      //  If others joined its flight, the next of them takes it over.
+      self->expired++;
+      if (s_service_promote(self, request, now)) {
+        int64_t queued_at = request->queued_at;
+        s_service_requeue(self, request);
+        request->queued_at = queued_at;
       }
-      if (self->verbose) {
-        zclock_log("I: received message:");
-        zmsg_dump(msg);
+      else {
+        s_request_destroy(&request);
       }
-      zframe_t *sender = zmsg_pop(msg);
-      zframe_t *empty  = zmsg_pop(msg);
-      zframe_t *header = zmsg_pop(msg);
+      continue;
+    }
 
-      if (zframe_streq(header, MDPC_CLIENT)) {
-        s_broker_client_msg(self, sender, msg);
-      }
-      else if (zframe_streq(header, MDPW_WORKER)) {
-        s_broker_worker_msg(self, sender, msg);
+    worker_t *worker = s_service_select(self, request);
+    wait_stats_t *waits = &self->waits[request->priority];
+    int64_t wait = self->broker->clock - request->queued_at;
+    waits->dispatched++;
+    waits->wait_total += wait;
+    if (wait > waits->wait_max) {
+      waits->wait_max = wait;
+    }
+    s_histogram_record(&self->wait_times, wait);
+
+    //  Ids start from 1, as 0 means none
+    if (++worker->next_dispatch == 0) {
+      worker->next_dispatch = 1;
+    }
+    //  A reissued request's token may still be shared with the message
+    //  that took it to the dead worker, so we mark a copy of it
+    zframe_t *client = zmsg_first(request->msg);
+    if (request->reissues) {
+      client = zmsg_pop(request->msg);
+      zframe_t *copy = zframe_dup(client);
+      zframe_destroy(&client);
+      zmsg_prepend(request->msg, &copy);
+      client = zmsg_first(request->msg);
+    }
+    dispatch_t *dispatch = &worker->dispatches[worker->inflight];
+    dispatch->id = worker->next_dispatch;
+    s_token_set_dispatch(client, dispatch->id);
+    dispatch->flight = s_token_flight(client);
+    dispatch->started = self->broker->clock;
+    dispatch->request = NULL;
+
+    mdp_props_t props;
+    mdp_props_init(&props);
+    if (request->deadline) {
+      mdp_props_put_number(&props, MDP_PROPS_BUDGET,
+        (uint32_t) (request->deadline - now));
+    }
+    zframe_t *frame = mdp_props_frame(&props);
+    s_worker_send_request(worker, &frame, request->msg);
+    if (self->broker->max_reissues) {
+      dispatch->request = request;
+    }
+    else {
+      s_request_destroy(&request);
+    }
+
+    if (++worker->inflight >= worker->limit) {
+      s_worker_unwait(worker);
+    }
+    else {
+      s_service_reorder(self, worker->slot);
+    }
+  }
+}
+
+// The select method picks the waiting worker with the fewest requests in
+// flight for its weight, which is the top of the waiting heap; of workers
+// with the same load, the one that has been waiting longest.
+// A request with an affinity key goes instead to the waiting worker that
+// scores highest for its key, by weighted rendezvous hashing, first over
+// the key groups that have a waiting worker, by the weight of all their
+// workers, then over the waiting workers of that group. So each key has
+// the same worker while that worker has capacity, and when a worker comes
+// or goes only the keys of its group, and the keys its group's change of
+// weight draws in or gives up, move. Past the in-flight limit of its
+// worker a key spills over to its next choice, which bounds the load any
+// one key can put on a worker.
+static worker_t *
+s_service_select(service_t *self, request_t *request)
+{
+  if (request->keyed) {
+    key_group_t *group = NULL;
+    double best_score = 0;
+    for (uint32_t index = 0; index < KEY_GROUPS; index++) {
+      if (self->groups[index].size) {
+        double score = s_key_score(index, self->groups[index].weight,
+          request->key);
+        if (group == NULL || score > best_score) {
+          group = &self->groups[index];
+          best_score = score;
+        }
       }
-      else {
-        zclock_log("E: invalid message:");
-        zmsg_dump(msg);
-        zmsg_destroy(&msg);
+    }
+    key_member_t *member = &group->waiting[0];
+    best_score = s_key_score(member->hash, member->weight, request->key);
+    worker_t *best = member->worker;
+    for (size_t slot = 1; slot < group->size; slot++) {
+      member = &group->waiting[slot];
+      double score = s_key_score(member->hash, member->weight, request->key);
+      if (score > best_score) {
+        best = member->worker;
+        best_score = score;
       }
-      zframe_destroy(&sender);
-      zframe_destroy(&empty);
-      zframe_destroy(&header);
     }
-    // Disconnect and delete any expired workers
-    // Send heartbeats to idle workers if needed
-    if (zclock_time() > self->heartbeat_at) {
-      s_broker_purge(self);
-      worker_t *worker = (worker_t *)zlist_first(self->waiting);
+    return best;
+  }
+  return self->waiting[0];
+}
+
+// The reorder method moves the worker in a slot of the waiting heap up or
+// down to where its load puts it, after it joined, left or changed load.
+// Each worker knows its slot, so this takes log time in the workers.
+static void
+s_service_reorder(service_t *self, size_t slot)
+{
+  worker_t *worker = self->waiting[slot];
+  while (slot > 0) {
+    size_t parent = (slot - 1) / 2;
+    if (!s_worker_before(worker, self->waiting[parent])) {
+      break;
+    }
+    self->waiting[slot] = self->waiting[parent];
+    self->waiting[slot]->slot = slot;
+    slot = parent;
+  }
+  while (2 * slot + 1 < self->nbr_waiting) {
+    size_t child = 2 * slot + 1;
+    if (child + 1 < self->nbr_waiting
+    &&  s_worker_before(self->waiting[child + 1], self->waiting[child])) {
+      child++;
+    }
+    if (!s_worker_before(self->waiting[child], worker)) {
+      break;
+    }
+    self->waiting[slot] = self->waiting[child];
+    self->waiting[slot]->slot = slot;
+    slot = child;
+  }
+  self->waiting[slot] = worker;
+  worker->slot = slot;
+}
 
-      while (worker) {
-        s_worker_send(worker, MDPW_HEARTBEAT, NULL, NULL);
-        worker = (worker_t *)zlist_next(self->waiting);
-      }
+// Checks the command frame in place against the service's filter
+static int
+s_service_is_command_enabled(service_t *self, zframe_t *command)
+{
+  return self->filter == NULL || !s_filter_match(self->filter, command);
+}
+
+// The join method looks for a flight with the same body as a new request,
+// if the service coalesces or caches its command, and before that for a
+// cached report, if it caches the command. If there is either, we take
+// the client's token, answer it from the cache or add it to the flight,
+// and drop the request; returns 1. Else we start a flight that the
+// request leads, and mark its token; returns 0. So a cached command is
+// coalesced too, and a miss goes to a worker only once.
+static int
+s_service_join(service_t *self, zframe_t *client, int64_t deadline,
+  zmsg_t **msg_p)
+{
+  broker_t *broker = self->broker;
+  zframe_t *command = zmsg_first(*msg_p);
+  if (command == NULL) {
+    return 0;
+  }
+  int cacheable = self->cacheable && broker->cache_bytes_max
+               && s_filter_match(self->cacheable, command);
+  if (!cacheable && (self->coalesce == NULL
+  || !s_filter_match(self->coalesce, command))) {
+    return 0;
+  }
+  //  The key is the body's frames, each after its size
+  size_t size = 0;
+  zframe_t *frame = zmsg_first(*msg_p);
+  while (frame) {
+    size += 4 + zframe_size(frame);
+    frame = zmsg_next(*msg_p);
+  }
+  byte *body = (byte *)zmalloc(size);
+  byte *next = body;
+  frame = zmsg_first(*msg_p);
+  while (frame) {
+    uint32_t frame_size = (uint32_t) zframe_size(frame);
+    next[0] = (byte) (frame_size >> 24);
+    next[1] = (byte) (frame_size >> 16);
+    next[2] = (byte) (frame_size >> 8);
+    next[3] = (byte) frame_size;
+    memcpy(next + 4, zframe_data(frame), frame_size);
+    next += 4 + frame_size;
+    frame = zmsg_next(*msg_p);
+  }
+  uint32_t hash = s_index_hash(body, size);
 
-      self->heartbeat_at = zclock_time() + HEARTBEAT_INTERVAL;
+  if (cacheable && self->cache) {
+    cache_entry_t *entry = (cache_entry_t *)s_index_lookup(self->cache,
+      body, size, hash);
+    if (entry && entry->expiry > s_wheel_time(broker->wheel)) {
+      self->hits++;
+      s_cache_entry_touch(entry);
+      zmsg_t *report = zmsg_dup(entry->report);
+      s_broker_client_send(broker, client, MDPC_REPORT, NULL, self->frame,
+        &report);
+      zframe_destroy(&client);
+      zmsg_destroy(msg_p);
+      free(body);
+      return 1;
+    }
+    if (entry) {
+      s_cache_entry_evict(entry);
     }
   }
-  if (zctx_interrupted) {
-    printf("W: interrupt received, shutting down...\n");
+  if (cacheable) {
+    self->misses++;
   }
 
-  s_broker_destroy(&self);
+  if (self->flights == NULL) {
+    self->flights = s_index_new();
+    self->flight_ids = s_index_new();
+  }
+  flight_t *flight =
+    (flight_t *)s_index_lookup(self->flights, body, size, hash);
+  if (flight) {
+    passenger_t *passenger = (passenger_t *)zmalloc(sizeof(passenger_t));
+    passenger->client = client;
+    passenger->deadline = deadline;
+    zlist_append(flight->clients, passenger);
+    self->coalesced++;
+    zmsg_destroy(msg_p);
+    free(body);
+    return 1;
+  }
+
+  //  Ids start from 1, as 0 means no flight
+  if (++self->next_flight == 0) {
+    self->next_flight = 1;
+  }
+  flight = (flight_t *)zmalloc(sizeof(flight_t));
+  flight->body = body;
+  flight->size = size;
+  flight->hash = hash;
+  flight->id[0] = (byte) (self->next_flight >> 24);
+  flight->id[1] = (byte) (self->next_flight >> 16);
+  flight->id[2] = (byte) (self->next_flight >> 8);
+  flight->id[3] = (byte) self->next_flight;
+  flight->clients = zlist_new();
+  flight->cacheable = cacheable;
+  flight->epoch = self->cache_epoch;
+  s_index_insert(self->flights, body, size, hash, flight);
+  s_index_insert(self->flight_ids, flight->id, 4,
+    s_index_hash(flight->id, 4), flight);
+
+  byte *token = zframe_data(client);
+  memcpy(token + 1 + token[0], flight->id, 4);
   return 0;
 }
+
+// The flight method finds a flight of the service by its id. Returns the
+// flight, or NULL if there is none.
+static flight_t *
+s_service_flight(service_t *self, uint32_t id)
+{
+  if (id == 0 || self->flights == NULL) {
+    return NULL;
+  }
+  byte key[4] = {
+    (byte) (id >> 24), (byte) (id >> 16), (byte) (id >> 8), (byte) id
+  };
+  return (flight_t *)s_index_lookup(self->flight_ids, key, 4,
+    s_index_hash(key, 4));
+}
+
+// The land method takes a flight off the service, by its id, so that no
+// more clients join it. Returns the flight, or NULL if there is none.
+static flight_t *
+s_service_land(service_t *self, uint32_t id)
+{
+  flight_t *flight = s_service_flight(self, id);
+  if (flight) {
+    s_index_delete(self->flight_ids, flight, s_index_hash(flight->id, 4));
+    s_index_delete(self->flights, flight, flight->hash);
+  }
+  return flight;
+}
+
+// The promote method hands a request whose client gave up to the first
+// passenger of its flight that has not given up too. The passenger's
+// token, marked with the flight id, takes the place of the client's, and
+// the request takes the passenger's deadline. Returns 1 if the request
+// has a new client; else 0, and the flight, if any, is gone.
+static int
+s_service_promote(service_t *self, request_t *request, int64_t now)
+{
+  zframe_t *client = zmsg_first(request->msg);
+  flight_t *flight = s_service_flight(self, s_token_flight(client));
+  if (flight == NULL) {
+    return 0;
+  }
+  passenger_t *passenger = (passenger_t *)zlist_pop(flight->clients);
+  while (passenger && passenger->deadline && now >= passenger->deadline) {
+    zframe_destroy(&passenger->client);
+    free(passenger);
+    passenger = (passenger_t *)zlist_pop(flight->clients);
+  }
+  if (passenger == NULL) {
+    flight = s_service_land(self, s_token_flight(client));
+    s_flight_destroy(&flight);
+    return 0;
+  }
+  byte *token = zframe_data(passenger->client);
+  memcpy(token + 1 + token[0], flight->id, 4);
+  request->size += zframe_size(passenger->client) - zframe_size(client);
+  request->deadline = passenger->deadline;
+  client = zmsg_pop(request->msg);
+  zframe_destroy(&client);
+  zmsg_prepend(request->msg, &passenger->client);
+  free(passenger);
+  return 1;
+}
+
+// The reply method sends a REPORT or NAK to the client of a request and,
+// if the request led a flight, a copy to each client that joined it. A
+// REPORT on a cacheable request is cached, unless the service's cached
+// reports were dropped while the request was out, as it may be stale.
+static void
+s_service_reply(service_t *self, zframe_t *client, char *command,
+  char *status, zmsg_t **msg_p)
+{
+  flight_t *flight = s_service_land(self, s_token_flight(client));
+  if (flight) {
+    if (flight->cacheable && flight->epoch == self->cache_epoch
+    &&  *command == *MDPC_REPORT) {
+      s_service_store(self, flight, *msg_p);
+    }
+    passenger_t *passenger = (passenger_t *)zlist_first(flight->clients);
+    while (passenger) {
+      zmsg_t *copy = zmsg_dup(*msg_p);
+      s_broker_client_send(self->broker, passenger->client, command, status,
+        self->frame, &copy);
+      passenger = (passenger_t *)zlist_next(flight->clients);
+    }
+    s_flight_destroy(&flight);
+  }
+  s_broker_client_send(self->broker, client, command, status, self->frame,
+    msg_p);
+}
+
+// The store method caches a copy of the report on a flight's request,
+// taking over the flight's body as its key. We evict the least recently
+// used reports of any service until it fits.
+static void
+s_service_store(service_t *self, flight_t *flight, zmsg_t *msg)
+{
+  broker_t *broker = self->broker;
+  size_t bytes = sizeof(cache_entry_t) + flight->size + zmsg_content_size(msg);
+  if (bytes > broker->cache_bytes_max || self->cache_ttl <= 0) {
+    return;
+  }
+  while (broker->cache_bytes + bytes > broker->cache_bytes_max) {
+    s_cache_entry_evict(broker->cache_tail);
+  }
+  if (self->cache == NULL) {
+    self->cache = s_index_new();
+  }
+  cache_entry_t *entry = (cache_entry_t *)s_index_lookup(self->cache,
+    flight->body, flight->size, flight->hash);
+  if (entry) {
+    s_cache_entry_evict(entry);
+  }
+
+  entry = (cache_entry_t *)zmalloc(sizeof(cache_entry_t));
+  entry->service = self;
+  entry->key = flight->body;
+  entry->size = flight->size;
+  entry->hash = flight->hash;
+  entry->report = zmsg_dup(msg);
+  entry->bytes = bytes;
+  entry->expiry = s_wheel_time(broker->wheel) + self->cache_ttl;
+  flight->body = NULL;
+  s_index_insert(self->cache, entry->key, entry->size, entry->hash, entry);
+  entry->next = broker->cache_head;
+  if (broker->cache_head) {
+    broker->cache_head->prev = entry;
+  }
+  else {
+    broker->cache_tail = entry;
+  }
+  broker->cache_head = entry;
+  broker->cache_bytes += bytes;
+}
+
+// The invalidate method drops the service's cached reports on commands
+// that match any of the rules, or all its cached reports if rules is
+// NULL or empty. Requests out at a worker now will not be cached either.
+// Returns the MMI status code.
+static char *
+s_service_invalidate(service_t *self, zmsg_t *rules)
+{
+  filter_t *filter = NULL;
+  zframe_t *rule = rules? zmsg_first(rules): NULL;
+  while (rule) {
+    if (!s_filter_valid(rule)) {
+      s_filter_destroy(&filter);
+      return "400";
+    }
+    if (filter == NULL) {
+      filter = s_filter_new();
+    }
+    s_filter_add(filter, rule);
+    rule = zmsg_next(rules);
+  }
+  self->cache_epoch++;
+
+  //  Deleting from the index moves entries about, so collect them first
+  zlist_t *stale = zlist_new();
+  for (size_t slot = 0; self->cache && slot < self->cache->limit; slot++) {
+    cache_entry_t *entry = (cache_entry_t *)self->cache->slots[slot].item;
+    if (entry && filter) {
+      //  The key starts with the command frame, after its size
+      byte *key = entry->key;
+      size_t size = ((size_t) key[0] << 24) | ((size_t) key[1] << 16)
+                  | ((size_t) key[2] << 8) | (size_t) key[3];
+      zframe_t *command = zframe_new(key + 4, size);
+      if (!s_filter_match(filter, command)) {
+        entry = NULL;
+      }
+      zframe_destroy(&command);
+    }
+    if (entry) {
+      zlist_append(stale, entry);
+    }
+  }
+  cache_entry_t *entry = (cache_entry_t *)zlist_pop(stale);
+  while (entry) {
+    s_cache_entry_evict(entry);
+    entry = (cache_entry_t *)zlist_pop(stale);
+  }
+  zlist_destroy(&stale);
+  s_filter_destroy(&filter);
+  return "200";
+}
+
+// Flight destructor, called once the flight has left its service
+static void
+s_flight_destroy(flight_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    flight_t *self = *self_p;
+    passenger_t *passenger = (passenger_t *)zlist_pop(self->clients);
+    while (passenger) {
+      zframe_destroy(&passenger->client);
+      free(passenger);
+      passenger = (passenger_t *)zlist_pop(self->clients);
+    }
+    zlist_destroy(&self->clients);
+    free(self->body);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// Here is the implementation of the cache entry. Evicting an entry takes
+// it out of its service's index and destroys it.
+static void
+s_cache_entry_evict(cache_entry_t *self)
+{
+  s_index_delete(self->service->cache, self, self->hash);
+  s_cache_entry_destroy(&self);
+}
+
+// Cache entry destructor, unlinks the entry from the broker's LRU list
+static void
+s_cache_entry_destroy(cache_entry_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    cache_entry_t *self = *self_p;
+    broker_t *broker = self->service->broker;
+    if (self->prev) {
+      self->prev->next = self->next;
+    }
+    else {
+      broker->cache_head = self->next;
+    }
+    if (self->next) {
+      self->next->prev = self->prev;
+    }
+    else {
+      broker->cache_tail = self->prev;
+    }
+    broker->cache_bytes -= self->bytes;
+    zmsg_destroy(&self->report);
+    free(self->key);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// Moves an entry to the head of the LRU list, as it was just used
+static void
+s_cache_entry_touch(cache_entry_t *self)
+{
+  broker_t *broker = self->service->broker;
+  if (broker->cache_head == self) {
+    return;
+  }
+  self->prev->next = self->next;
+  if (self->next) {
+    self->next->prev = self->prev;
+  }
+  else {
+    broker->cache_tail = self->prev;
+  }
+  self->prev = NULL;
+  self->next = broker->cache_head;
+  broker->cache_head->prev = self;
+  broker->cache_head = self;
+}
+
+// Here is the implementation of the methods that work on a worker.
+// Lazy constructor that locates a worker by routing id, or creates a new
+// worker if there is no worker already with that routing id.
+static worker_t *
+s_worker_require(broker_t *self, zframe_t *address)
+{
+  assert(address);
+
+  // self->workers is keyed off the raw routing id
+  uint32_t hash = s_index_hash(zframe_data(address), zframe_size(address));
+  worker_t *worker = (worker_t *)s_index_lookup(self->workers,
+    zframe_data(address), zframe_size(address), hash);
+
+  if (worker == NULL) {
+    worker = (worker_t *)zmalloc(sizeof(worker_t));
+    worker->broker = self;
+    worker->identity = zframe_strhex(address);
+    worker->address = zframe_dup(address);
+    worker->hash = hash;
+    worker->expiry_timer.handler = s_worker_expire;
+    worker->expiry_timer.arg = worker;
+    worker->heartbeat_timer.handler = s_worker_heartbeat;
+    worker->heartbeat_timer.arg = worker;
+
+    s_index_insert(self->workers, zframe_data(worker->address),
+      zframe_size(worker->address), hash, worker);
+
+    if (self->verbose) {
+      zclock_log ("I: registering new worker: %s", worker->identity);
+    }
+  }
+
+  return worker;
+}
+
+// The waiting method puts a worker with spare capacity back on its
+// service's waiting heap, then gives the service a chance to dispatch.
+// The heap keeps the least loaded worker on top, so a worker joins,
+// leaves or moves in log time, however many workers the service has.
+static void
+s_worker_waiting(worker_t *self)
+{
+  service_t *service = self->service;
+  assert(service);
+  assert(!self->waiting);
+
+  if (service->nbr_waiting == service->waiting_limit) {
+    service->waiting_limit = service->waiting_limit?
+      service->waiting_limit * 2: 4;
+    service->waiting = (worker_t **)realloc(service->waiting,
+      service->waiting_limit * sizeof(worker_t *));
+    assert(service->waiting);
+  }
+  self->waiting = 1;
+  self->turn = service->turns++;
+  service->waiting[service->nbr_waiting++] = self;
+  s_service_reorder(service, service->nbr_waiting - 1);
+
+  key_group_t *group = &service->groups[self->hash % KEY_GROUPS];
+  if (group->size == group->limit) {
+    group->limit = group->limit? group->limit * 2: 4;
+    group->waiting = (key_member_t *)realloc(group->waiting,
+      group->limit * sizeof(key_member_t));
+    assert(group->waiting);
+  }
+  self->group_slot = group->size++;
+  group->waiting[self->group_slot].hash = self->hash;
+  group->waiting[self->group_slot].weight = self->weight;
+  group->waiting[self->group_slot].worker = self;
+  s_service_dispatch(service);
+}
+
+// Orders waiting workers on the heap: the one with the fewest requests in
+// flight for its weight first, then the one that has waited longest
+static int
+s_worker_before(worker_t *self, worker_t *other)
+{
+  size_t load = self->inflight * other->weight;
+  size_t other_load = other->inflight * self->weight;
+  return load < other_load
+      || (load == other_load && self->turn < other->turn);
+}
+
+// Takes a worker off its service's waiting heap, if it is on it
+static void
+s_worker_unwait(worker_t *self)
+{
+  service_t *service = self->service;
+  if (!self->waiting) {
+    return;
+  }
+  //  The last worker of the heap takes its slot
+  worker_t *last = service->waiting[--service->nbr_waiting];
+  if (last != self) {
+    service->waiting[self->slot] = last;
+    s_service_reorder(service, self->slot);
+  }
+
+  //  The last waiting worker of the group takes its slot
+  key_group_t *group = &service->groups[self->hash % KEY_GROUPS];
+  key_member_t *member = &group->waiting[--group->size];
+  group->waiting[self->group_slot] = *member;
+  member->worker->group_slot = self->group_slot;
+  self->waiting = 0;
+}
+
+// The expiry timer deletes a worker we have not heard from within
+// HEARTBEAT_EXPIRY. The timer is not moved on every message; when it fires
+// early we just arm it again for the worker's current expiry.
+static void
+s_worker_expire(wheel_timer_t *timer, void *arg)
+{
+  worker_t *self = (worker_t *)arg;
+  wheel_t *wheel = self->broker->wheel;
+
+  if (s_wheel_time(wheel) < self->expiry) {
+    s_wheel_add(wheel, timer, self->expiry);
+  }
+  else {
+    if (self->broker->verbose) {
+      zclock_log("I: deleting expired worker: %s", self->identity);
+    }
+    s_worker_delete(self, 0);
+  }
+}
+
+// The heartbeat timer sends a HEARTBEAT once the worker has had no message
+// from us for HEARTBEAT_INTERVAL. Requests keep the worker's liveness up
+// just as well, so busy workers get no heartbeats at all.
+static void
+s_worker_heartbeat(wheel_timer_t *timer, void *arg)
+{
+  worker_t *self = (worker_t *)arg;
+  wheel_t *wheel = self->broker->wheel;
+
+  if (s_wheel_time(wheel) >= self->sent_at + HEARTBEAT_INTERVAL) {
+    s_worker_send(self, MDPW_HEARTBEAT, NULL, NULL);
+  }
+  s_wheel_add(wheel, timer, self->sent_at + HEARTBEAT_INTERVAL);
+}
+
+//  The delete method deletes the current worker. The requests it had in
+//  flight go back on the queue, to be sent to another worker, unless they
+//  went out too often already; then we NAK them, as they may be what
+//  kills workers. If reissues are off we kept no request, and its
+//  clients will time out.
+static void
+s_worker_delete(worker_t *self, int disconnect)
+{
+  assert(self);
+  service_t *service = self->service;
+
+  if (disconnect) {
+    s_worker_send(self, MDPW_DISCONNECT, NULL, NULL);
+  }
+
+  if (service) {
+    s_worker_unwait(self);
+    service->groups[self->hash % KEY_GROUPS].weight -= self->weight;
+    if (--service->workers == 0) {
+      service->expiry = s_wheel_time(self->broker->wheel) + SERVICE_EXPIRY;
+    }
+    for (size_t index = 0; index < self->inflight; index++) {
+      request_t *request = self->dispatches[index].request;
+      self->dispatches[index].request = NULL;
+      if (request == NULL) {
+        flight_t *flight = s_service_land(service,
+          self->dispatches[index].flight);
+        s_flight_destroy(&flight);
+      }
+      else if (request->reissues++ < self->broker->max_reissues) {
+        service->reissued++;
+        s_service_requeue(service, request);
+      }
+      else {
+        zframe_t *client = zmsg_unwrap(request->msg);
+        service->naks++;
+        s_service_reply(service, client, MDPC_NAK, NAK_FAILED, &request->msg);
+        zframe_destroy(&client);
+        s_request_destroy(&request);
+      }
+    }
+  }
+
+  s_wheel_cancel(&self->expiry_timer);
+  s_wheel_cancel(&self->heartbeat_timer);
+  //  Tell the front thread to stop routing this worker to us
+  if (self->broker->sharded) {
+    s_send_frame(self->broker->backend, self->broker->empty, ZFRAME_MORE);
+    s_send_frame(self->broker->backend, self->address, 0);
+  }
+
+  s_index_delete(self->broker->workers, self, self->hash);
+  s_worker_destroy(&self);
+  if (service) {
+    s_service_dispatch(service);
+  }
+}
+
+// Times a worker over a request it reported on, and forgets the request.
+// Reports may come back in any order from a worker with several requests
+// in flight, so we match them by the dispatch id in their token. Returns
+// 1 if the report was for a request in flight, else 0.
+static int
+s_worker_completed(worker_t *self, zframe_t *client)
+{
+  uint32_t id = s_token_dispatch(client);
+  for (size_t index = 0; index < self->inflight; index++) {
+    if (self->dispatches[index].id == id) {
+      service_t *service = self->service;
+      service->completed++;
+      s_histogram_record(&service->service_times,
+        self->broker->clock - self->dispatches[index].started);
+      s_request_destroy(&self->dispatches[index].request);
+
+      //  Keep the rest in the order they went out
+      memmove(&self->dispatches[index], &self->dispatches[index + 1],
+        (self->inflight - index - 1) * sizeof(dispatch_t));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Scores a worker, or a key group, for an affinity key. We mix the hash
+// of the worker's address, or the group's number, with the key, as the
+// murmur3 finalizer does, into a number between 0 and 1, and scale that
+// so that each wins its weight's share of the keys.
+static double
+s_key_score(uint32_t hash, size_t weight, uint32_t key)
+{
+  uint32_t mix = hash ^ key;
+  mix ^= mix >> 16;
+  mix *= 0x85ebca6bu;
+  mix ^= mix >> 13;
+  mix *= 0xc2b2ae35u;
+  mix ^= mix >> 16;
+  double unit = ((double) mix + 0.5) / 4294967296.0;
+  return -(double) weight / log(unit);
+}
+
+// Worker destructor, called once the worker has left broker->workers.
+static void
+s_worker_destroy(worker_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    worker_t *self = *self_p;
+    zframe_destroy(&self->address);
+    for (size_t index = 0; index < self->inflight; index++) {
+      s_request_destroy(&self->dispatches[index].request);
+    }
+    free(self->dispatches);
+    free(self->identity);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// The send method formats and sends a command to a worker. The caller may
+// also provide a command option, and a message payload. The payload is
+// owned by the send method and goes out without being copied.
+static char *mdpw_commands [] = {
+  NULL, "READY", "REQUEST", "REPORT", "HEARTBEAT", "DISCONNECT"
+};
+
+static void
+s_worker_send(worker_t *self, char *command, char *option, zmsg_t **msg_p)
+{
+  broker_t *broker = self->broker;
+  zmsg_t *msg = msg_p? *msg_p : NULL;
+  self->sent_at = s_wheel_time(broker->wheel);
+
+  if (broker->verbose) {
+    zclock_log("I: sending %s to worker", mdpw_commands [(int) *command]);
+    if (msg) {
+      zmsg_dump(msg);
+    }
+  }
+
+  //  Stack routing and protocol envelope from constant frames
+  int more = msg && zmsg_size(msg) > 0? ZFRAME_MORE: 0;
+  s_send_frame(broker->backend, self->address, ZFRAME_MORE);
+  s_send_frame(broker->backend, broker->empty, ZFRAME_MORE);
+  s_send_frame(broker->backend, broker->worker_header, ZFRAME_MORE);
+  s_send_frame(broker->backend, broker->worker_commands[(int) *command],
+    option || more? ZFRAME_MORE: 0);
+  if (option) {
+    if (more) {
+      zstr_sendm(broker->backend, option);
+    }
+    else {
+      zstr_send(broker->backend, option);
+    }
+  }
+
+  if (more) {
+    zmsg_send(msg_p, broker->backend);
+  }
+  else if (msg_p) {
+    zmsg_destroy(msg_p);
+  }
+}
+
+// The send request method sends a request to a worker, with the props for
+// it, and leaves the request intact so that it can go out again if the
+// worker dies. Its frames go out with ZFRAME_REUSE, so libzmq shares the
+// data of large bodies rather than copying them.
+static void
+s_worker_send_request(worker_t *self, zframe_t **props_p, zmsg_t *msg)
+{
+  broker_t *broker = self->broker;
+  self->sent_at = s_wheel_time(broker->wheel);
+
+  if (broker->verbose) {
+    zclock_log("I: sending %s to worker", mdpw_commands [(int) *MDPW_REQUEST]);
+    zmsg_dump(msg);
+  }
+
+  s_send_frame(broker->backend, self->address, ZFRAME_MORE);
+  s_send_frame(broker->backend, broker->empty, ZFRAME_MORE);
+  s_send_frame(broker->backend, broker->worker_header, ZFRAME_MORE);
+  s_send_frame(broker->backend, broker->worker_commands[(int) *MDPW_REQUEST],
+    ZFRAME_MORE);
+  zframe_send(props_p, broker->backend, ZFRAME_MORE);
+
+  zframe_t *frame = zmsg_first(msg);
+  while (frame) {
+    zframe_t *next = zmsg_next(msg);
+    s_send_frame(broker->backend, frame, next? ZFRAME_MORE: 0);
+    frame = next;
+  }
+}
+
+
+// Here is the implementation of the index. The table is kept at most half
+// full, and deletion shifts later entries back into the freed slot, so
+// probe sequences stay short and need no tombstones.
+static index_t *
+s_index_new(void)
+{
+  index_t *self = (index_t *)zmalloc(sizeof(index_t));
+  self->limit = INDEX_INITIAL_SIZE;
+  self->slots = (index_slot_t *)zmalloc(self->limit * sizeof(index_slot_t));
+  return self;
+}
+
+static void
+s_index_destroy(index_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    index_t *self = *self_p;
+    free(self->slots);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// FNV-1a over the key bytes
+static uint32_t
+s_index_hash(const byte *key, size_t size)
+{
+  uint32_t hash = 2166136261u;
+
+  for (size_t byte_nbr = 0; byte_nbr < size; byte_nbr++) {
+    hash ^= key[byte_nbr];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void *
+s_index_lookup(index_t *self, const byte *key, size_t size, uint32_t hash)
+{
+  size_t mask = self->limit - 1;
+  index_slot_t *slot = &self->slots[hash & mask];
+
+  while (slot->item) {
+    if (slot->hash == hash && slot->size == size
+    &&  memcmp(slot->key, key, size) == 0) {
+      return slot->item;
+    }
+    slot = &self->slots[(slot - self->slots + 1) & mask];
+  }
+  return NULL;
+}
+
+static void
+s_index_insert(index_t *self, const byte *key, size_t size, uint32_t hash,
+  void *item)
+{
+  assert(item);
+
+  //  Grow the table before it gets more than half full
+  if ((self->size + 1) * 2 > self->limit) {
+    index_slot_t *slots = self->slots;
+    size_t limit = self->limit;
+
+    self->limit = limit * 2;
+    self->slots = (index_slot_t *)zmalloc(self->limit * sizeof(index_slot_t));
+    self->size = 0;
+    for (size_t slot = 0; slot < limit; slot++) {
+      if (slots[slot].item) {
+        s_index_insert(self, slots[slot].key, slots[slot].size,
+          slots[slot].hash, slots[slot].item);
+      }
+    }
+    free(slots);
+  }
+
+  size_t mask = self->limit - 1;
+  size_t slot = hash & mask;
+  while (self->slots[slot].item) {
+    slot = (slot + 1) & mask;
+  }
+  self->slots[slot].key = key;
+  self->slots[slot].size = size;
+  self->slots[slot].hash = hash;
+  self->slots[slot].item = item;
+  self->size++;
+}
+
+static void
+s_index_delete(index_t *self, void *item, uint32_t hash)
+{
+  size_t mask = self->limit - 1;
+  size_t slot = hash & mask;
+
+  while (self->slots[slot].item != item) {
+    if (self->slots[slot].item == NULL) {
+      return;           //  Not in the index
+    }
+    slot = (slot + 1) & mask;
+  }
+  self->slots[slot].item = NULL;
+  self->size--;
+
+  //  Move back any following entry whose probe sequence passed the hole
+  size_t hole = slot;
+  slot = (slot + 1) & mask;
+  while (self->slots[slot].item) {
+    size_t home = self->slots[slot].hash & mask;
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      self->slots[hole] = self->slots[slot];
+      self->slots[slot].item = NULL;
+      hole = slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+
+// Here is the implementation of the command filter. Rules are stored as
+// NUL-terminated copies which also serve as their own index keys.
+static filter_t *
+s_filter_new(void)
+{
+  filter_t *self = (filter_t *)zmalloc(sizeof(filter_t));
+  self->exact = s_index_new();
+  self->prefixes = s_index_new();
+  self->patterns = zlist_new();
+  return self;
+}
+
+static void
+s_filter_destroy(filter_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    filter_t *self = *self_p;
+    for (size_t slot = 0; slot < self->exact->limit; slot++) {
+      free(self->exact->slots[slot].item);
+    }
+    for (size_t slot = 0; slot < self->prefixes->limit; slot++) {
+      free(self->prefixes->slots[slot].item);
+    }
+    char *pattern = (char *)zlist_pop(self->patterns);
+    while (pattern) {
+      free(pattern);
+      pattern = (char *)zlist_pop(self->patterns);
+    }
+    s_index_destroy(&self->exact);
+    s_index_destroy(&self->prefixes);
+    zlist_destroy(&self->patterns);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// A rule is a command name, a prefix ending in '*', or a pattern where
+// '*' matches any run of characters and '?' any one character.
+static int
+s_filter_valid(zframe_t *rule)
+{
+  size_t size = zframe_size(rule);
+  return size > 0 && size <= FILTER_RULE_MAX
+      && memchr(zframe_data(rule), 0, size) == NULL;
+}
+
+// Works out which table a rule belongs to. Returns the index for exact
+// and prefix rules, setting *size_p to the length of the key, or NULL
+// for a wildcard pattern.
+static index_t *
+s_filter_table(filter_t *self, zframe_t *rule, size_t *size_p)
+{
+  char *data = (char *)zframe_data(rule);
+  size_t size = zframe_size(rule);
+  char *wildcard = (char *)memchr(data, '*', size);
+  char *single = (char *)memchr(data, '?', size);
+
+  if (wildcard == NULL && single == NULL) {
+    *size_p = size;
+    return self->exact;
+  }
+  if (single == NULL && wildcard == data + size - 1
+  &&  size - 1 <= FILTER_PREFIX_MAX) {
+    *size_p = size - 1;
+    return self->prefixes;
+  }
+  return NULL;
+}
+
+static void
+s_filter_add(filter_t *self, zframe_t *rule)
+{
+  size_t size;
+  index_t *table = s_filter_table(self, rule, &size);
+  byte *data = zframe_data(rule);
+
+  if (table == NULL) {
+    char *pattern = (char *)zlist_first(self->patterns);
+    while (pattern) {
+      if (strlen(pattern) == zframe_size(rule)
+      &&  memcmp(pattern, data, zframe_size(rule)) == 0) {
+        return;         //  Already disabled
+      }
+      pattern = (char *)zlist_next(self->patterns);
+    }
+    zlist_append(self->patterns, zframe_strdup(rule));
+    self->rules++;
+    return;
+  }
+
+  uint32_t hash = s_index_hash(data, size);
+  if (s_index_lookup(table, data, size, hash) == NULL) {
+    char *key = (char *)zmalloc(size + 1);
+    memcpy(key, data, size);
+    s_index_insert(table, (byte *)key, size, hash, key);
+    if (table == self->prefixes) {
+      self->lengths[size]++;
+    }
+    self->rules++;
+  }
+}
+
+static void
+s_filter_remove(filter_t *self, zframe_t *rule)
+{
+  size_t size;
+  index_t *table = s_filter_table(self, rule, &size);
+  byte *data = zframe_data(rule);
+
+  if (table == NULL) {
+    char *pattern = (char *)zlist_first(self->patterns);
+    while (pattern) {
+      if (strlen(pattern) == zframe_size(rule)
+      &&  memcmp(pattern, data, zframe_size(rule)) == 0) {
+        zlist_remove(self->patterns, pattern);
+        free(pattern);
+        self->rules--;
+        return;
+      }
+      pattern = (char *)zlist_next(self->patterns);
+    }
+    return;
+  }
+
+  uint32_t hash = s_index_hash(data, size);
+  char *key = (char *)s_index_lookup(table, data, size, hash);
+  if (key) {
+    s_index_delete(table, key, hash);
+    free(key);
+    if (table == self->prefixes) {
+      self->lengths[size]--;
+    }
+    self->rules--;
+  }
+}
+
+// The update method applies one mmi.filter or mmi.coalesce request to a
+// service's rules. The operation is add or remove, as named by the caller,
+// to add or remove rules, "replace" to swap in a new set of rules, or
+// "clear" to drop them all. Every rule is checked before any is applied,
+// so a request takes effect entirely or not at all. Returns the MMI
+// status code.
+static char *
+s_filter_update(filter_t **self_p, zframe_t *operation, zmsg_t *rules,
+  char *add_name, char *remove_name)
+{
+  int replace = zframe_streq(operation, "replace");
+  int clear = zframe_streq(operation, "clear");
+  int adding = zframe_streq(operation, add_name);
+  int removing = zframe_streq(operation, remove_name);
+
+  if (!(replace || clear || adding || removing)) {
+    return "400";
+  }
+  if ((adding || removing) && zmsg_size(rules) == 0) {
+    return "400";
+  }
+  zframe_t *rule = zmsg_first(rules);
+  while (rule) {
+    if (!s_filter_valid(rule)) {
+      return "400";
+    }
+    rule = zmsg_next(rules);
+  }
+
+  if (replace || clear) {
+    s_filter_destroy(self_p);
+  }
+  if (zmsg_size(rules) > 0 && !removing && *self_p == NULL) {
+    *self_p = s_filter_new();
+  }
+
+  rule = zmsg_first(rules);
+  while (rule && *self_p) {
+    if (removing) {
+      s_filter_remove(*self_p, rule);
+    }
+    else {
+      s_filter_add(*self_p, rule);
+    }
+    rule = zmsg_next(rules);
+  }
+
+  if (*self_p && (*self_p)->rules == 0) {
+    s_filter_destroy(self_p);
+  }
+  return "200";
+}
+
+
+// Matches a command against a wildcard pattern, backtracking to the last
+// '*' on a mismatch.
+static int
+s_filter_glob(const char *pattern, const byte *data, size_t size)
+{
+  const char *star = NULL;
+  size_t pos = 0, resume = 0;
+
+  while (pos < size) {
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = pos;
+    }
+    else if (*pattern && (*pattern == '?' || *pattern == (char)data[pos])) {
+      pattern++;
+      pos++;
+    }
+    else if (star) {
+      pattern = star + 1;
+      pos = ++resume;
+    }
+    else {
+      return 0;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == 0;
+}
+
+// Returns 1 if the command is disabled. The prefix hash is built up one
+// byte at a time while we walk the command, and probed at each length
+// that has prefix rules, so the command bytes are read only once.
+static int
+s_filter_match(filter_t *self, zframe_t *command)
+{
+  byte *data = zframe_data(command);
+  size_t size = zframe_size(command);
+  uint32_t hash = 2166136261u;
+
+  for (size_t length = 0;
+       length <= size && length <= FILTER_PREFIX_MAX; length++) {
+    if (self->lengths[length]
+    &&  s_index_lookup(self->prefixes, data, length, hash)) {
+      return 1;
+    }
+    if (length < size) {
+      hash ^= data[length];
+      hash *= 16777619u;
+    }
+  }
+  if (size > FILTER_PREFIX_MAX) {
+    hash = s_index_hash(data, size);
+  }
+  if (s_index_lookup(self->exact, data, size, hash)) {
+    return 1;
+  }
+
+  char *pattern = (char *)zlist_first(self->patterns);
+  while (pattern) {
+    if (s_filter_glob(pattern, data, size)) {
+      return 1;
+    }
+    pattern = (char *)zlist_next(self->patterns);
+  }
+  return 0;
+}
+
+
+// Here is the implementation of the histogram. Values below HISTOGRAM_SUB
+// get a bucket each; above that, a value's top HISTOGRAM_SUB_BITS + 1
+// bits pick its bucket.
+static void
+s_histogram_record(histogram_t *self, int64_t value)
+{
+  if (value < 0) {
+    value = 0;
+  }
+  if (value > UINT32_MAX) {
+    value = UINT32_MAX;
+  }
+  size_t bucket = (size_t) value;
+  if (value >= HISTOGRAM_SUB) {
+    int magnitude = 31 - __builtin_clz((uint32_t) value);
+    size_t sub = (size_t) (value >> (magnitude - HISTOGRAM_SUB_BITS));
+    bucket = (size_t) (magnitude - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB
+           + (sub & (HISTOGRAM_SUB - 1));
+  }
+  self->counts[bucket]++;
+  self->samples++;
+  if (value > self->max) {
+    self->max = value;
+  }
+}
+
+// Returns the lowest value that falls in a bucket
+static int64_t
+s_histogram_lowest(size_t bucket)
+{
+  if (bucket < HISTOGRAM_SUB) {
+    return (int64_t) bucket;
+  }
+  int magnitude = (int) (bucket / HISTOGRAM_SUB) + HISTOGRAM_SUB_BITS - 1;
+  int64_t base = HISTOGRAM_SUB + (int64_t) (bucket % HISTOGRAM_SUB);
+  return base << (magnitude - HISTOGRAM_SUB_BITS);
+}
+
+// Returns the highest value of the bucket that holds the given percentile
+// of samples, or 0 if there are none
+static int64_t
+s_histogram_percentile(histogram_t *self, double percentile)
+{
+  uint64_t rank = (uint64_t) (self->samples * percentile / 100.0 + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += self->counts[bucket];
+    if (seen >= rank) {
+      int64_t highest = bucket + 1 < HISTOGRAM_BUCKETS?
+        s_histogram_lowest(bucket + 1) - 1: UINT32_MAX;
+      return highest < self->max? highest: self->max;
+    }
+  }
+  return 0;
+}
+
+// Adds a histogram to an mmi.stats reply:
+// [samples][p50][p90][p99][max][buckets]
+static void
+s_histogram_dump(histogram_t *self, zmsg_t *msg)
+{
+  zmsg_addstrf(msg, "%" PRIu64, self->samples);
+  zmsg_addstrf(msg, "%" PRId64, s_histogram_percentile(self, 50));
+  zmsg_addstrf(msg, "%" PRId64, s_histogram_percentile(self, 90));
+  zmsg_addstrf(msg, "%" PRId64, s_histogram_percentile(self, 99));
+  zmsg_addstrf(msg, "%" PRId64, self->max);
+
+  char buckets[HISTOGRAM_BUCKETS * 32];
+  size_t size = 0;
+  buckets[0] = 0;
+  for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    if (self->counts[bucket]) {
+      size += snprintf(buckets + size, sizeof(buckets) - size,
+        "%s%" PRId64 ":%" PRIu64, size? " ": "",
+        s_histogram_lowest(bucket), self->counts[bucket]);
+    }
+  }
+  zmsg_addstr(msg, buckets);
+}
+
+
+// Here is the implementation of the timer wheel. Times given to and taken
+// from the wheel are in msecs, on the zclock_mono clock; the wheel itself
+// counts in ticks of WHEEL_TICK msecs.
+static wheel_t *
+s_wheel_new(int64_t now)
+{
+  wheel_t *self = (wheel_t *)zmalloc(sizeof(wheel_t));
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < WHEEL_SIZE; slot++) {
+      wheel_timer_t *head = &self->slots[level][slot];
+      head->next = head->prev = head;
+    }
+  }
+  self->now = now / WHEEL_TICK;
+  return self;
+}
+
+static void
+s_wheel_destroy(wheel_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    free(*self_p);
+    *self_p = NULL;
+  }
+}
+
+// Returns the wheel's current time, which is cheaper than asking the clock
+static int64_t
+s_wheel_time(wheel_t *self)
+{
+  return self->now * WHEEL_TICK;
+}
+
+// Puts an armed timer on the slot list for its expiry tick
+static void
+s_wheel_link(wheel_t *self, wheel_timer_t *timer)
+{
+  int64_t delta = timer->expires - self->now;
+  int level = 0;
+
+  while (level < WHEEL_LEVELS - 1
+      && delta >= ((int64_t) 1 << (WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+  if (delta >= ((int64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+    timer->expires =
+      self->now + ((int64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  }
+  size_t slot = (timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+  wheel_timer_t *head = &self->slots[level][slot];
+
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+// Arms or re-arms a timer to fire at the given time, in msecs
+static void
+s_wheel_add(wheel_t *self, wheel_timer_t *timer, int64_t when)
+{
+  s_wheel_cancel(timer);
+  timer->expires = (when + WHEEL_TICK - 1) / WHEEL_TICK;
+  if (timer->expires <= self->now) {
+    timer->expires = self->now + 1;
+  }
+  s_wheel_link(self, timer);
+}
+
+static void
+s_wheel_cancel(wheel_timer_t *timer)
+{
+  if (timer->next) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+  }
+}
+
+// Moves all timers off a slot list onto a list of our own
+static void
+s_wheel_splice(wheel_timer_t *head, wheel_timer_t *list)
+{
+  if (head->next == head) {
+    list->next = list->prev = list;
+  }
+  else {
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+  }
+}
+
+// Moves time forward to the given msecs, cascading timers down from the
+// higher levels and firing each timer as its tick comes. A handler may
+// arm or cancel any timer, including others that fire on the same tick.
+static void
+s_wheel_advance(wheel_t *self, int64_t now)
+{
+  int64_t target = now / WHEEL_TICK;
+
+  while (self->now < target) {
+    self->now++;
+
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+      if ((self->now & (((int64_t) 1 << (WHEEL_BITS * level)) - 1)) == 0) {
+        wheel_timer_t list;
+        size_t slot = (self->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+        s_wheel_splice(&self->slots[level][slot], &list);
+        while (list.next != &list) {
+          wheel_timer_t *timer = list.next;
+          s_wheel_cancel(timer);
+          s_wheel_link(self, timer);
+        }
+      }
+    }
+
+    wheel_timer_t list;
+    s_wheel_splice(&self->slots[0][self->now & (WHEEL_SIZE - 1)], &list);
+    while (list.next != &list) {
+      wheel_timer_t *timer = list.next;
+      s_wheel_cancel(timer);
+      timer->handler(timer, timer->arg);
+    }
+  }
+}
+
+// Returns how many msecs we can wait before the wheel has work to do,
+// that is, until the next armed level 0 slot or the next cascade.
+static int
+s_wheel_timeout(wheel_t *self)
+{
+  int ticks = WHEEL_SIZE - (int) (self->now & (WHEEL_SIZE - 1));
+
+  for (int tick = 1; tick < ticks; tick++) {
+    wheel_timer_t *head =
+      &self->slots[0][(self->now + tick) & (WHEEL_SIZE - 1)];
+    if (head->next != head) {
+      ticks = tick;
+      break;
+    }
+  }
+  return ticks * WHEEL_TICK;
+}
+
+
+// Here is the implementation of the peer. The DEALER never blocks: we
+// only send to it when it has room, and read from it when it has input.
+static peer_t *
+s_peer_new(broker_t *broker, char *endpoint)
+{
+  peer_t *self = (peer_t *)zmalloc(sizeof(peer_t));
+  self->broker = broker;
+  self->endpoint = strdup(endpoint);
+  self->socket = zsock_new_dealer(endpoint);
+  zsock_set_sndtimeo(self->socket, 0);
+  self->services = s_index_new();
+  zclock_log("I: forwarding to peer at %s", endpoint);
+  return self;
+}
+
+static void
+s_peer_destroy(peer_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    peer_t *self = *self_p;
+    for (size_t slot = 0; slot < self->services->limit; slot++) {
+      advert_t *advert = (advert_t *)self->services->slots[slot].item;
+      if (advert) {
+        zframe_destroy(&advert->name);
+        free(advert);
+      }
+    }
+    s_index_destroy(&self->services);
+    zsock_destroy(&self->socket);
+    free(self->endpoint);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// Sends a request to the peer as its client. The request keeps its budget
+// and priority, and carries the token of our client as its tag. Returns 0
+// if OK, or -1 if the peer has no room for it, and the request is left
+// with the caller.
+static int
+s_peer_forward(peer_t *self, zframe_t *client, zframe_t *props,
+  zframe_t *service_frame, zmsg_t **msg_p)
+{
+  broker_t *broker = self->broker;
+  mdp_props_t forward;
+  mdp_props_init(&forward);
+  int64_t budget = mdp_props_get_number(props, MDP_PROPS_BUDGET, -1);
+  int64_t priority = mdp_props_get_number(props, MDP_PROPS_PRIORITY, -1);
+  int64_t key_frame = mdp_props_get_number(props, MDP_PROPS_KEY, -1);
+  if (budget >= 0) {
+    mdp_props_put_number(&forward, MDP_PROPS_BUDGET, (uint32_t) budget);
+  }
+  if (priority >= 0) {
+    mdp_props_put_number(&forward, MDP_PROPS_PRIORITY, (uint32_t) priority);
+  }
+  if (key_frame >= 0) {
+    mdp_props_put_number(&forward, MDP_PROPS_KEY, (uint32_t) key_frame);
+  }
+  if (mdp_props_put(&forward, MDP_PROPS_TAG, zframe_data(client),
+      zframe_size(client)) == -1
+  || !(zsock_events(self->socket) & ZMQ_POLLOUT)) {
+    return -1;
+  }
+  if (broker->verbose) {
+    zclock_log("I: forwarding request to %s", self->endpoint);
+  }
+  zframe_t *frame = mdp_props_frame(&forward);
+  s_send_frame(self->socket, broker->empty, ZFRAME_MORE);
+  s_send_frame(self->socket, broker->client_header, ZFRAME_MORE);
+  zframe_send(&frame, self->socket, ZFRAME_MORE);
+  s_send_frame(self->socket, service_frame, ZFRAME_MORE);
+  zmsg_send(msg_p, self->socket);
+  return 0;
+}
+
+// Reads up to a batch of messages from the peer
+static void
+s_peer_drain(peer_t *self)
+{
+  for (size_t count = 0; count < self->broker->batch; count++) {
+    zmsg_t *msg = s_recv_nowait(self->socket);
+    if (!msg) {
+      break;            // Drained, or interrupted
+    }
+    s_peer_recv(self, msg);
+  }
+}
+
+// Handles a reply from the peer: either to a request we forwarded, which
+// goes back to the client its tag names, or to mmi.services
+static void
+s_peer_recv(peer_t *self, zmsg_t *msg)
+{
+  broker_t *broker = self->broker;
+  zframe_t *empty = zmsg_pop(msg);
+  zframe_t *header = zmsg_pop(msg);
+  zframe_t *command = zmsg_pop(msg);
+  zframe_t *props = mdp_props_is(zmsg_first(msg))? zmsg_pop(msg): NULL;
+  zframe_t *service_frame = zmsg_pop(msg);
+  size_t tag_size;
+  const byte *tag = mdp_props_get(props, MDP_PROPS_TAG, &tag_size);
+
+  if (service_frame == NULL || !zframe_streq(header, MDPC_CLIENT)) {
+    zclock_log("E: invalid message from peer %s", self->endpoint);
+  }
+  else if (tag) {
+    zframe_t *client = zframe_new(tag, tag_size);
+    s_broker_client_send(broker, client,
+      zframe_streq(command, MDPC_NAK)? MDPC_NAK: MDPC_REPORT, NULL,
+      service_frame, &msg);
+    zframe_destroy(&client);
+  }
+  else if (zframe_streq(service_frame, "mmi.services")) {
+    s_peer_update(self, msg);
+  }
+  zframe_destroy(&empty);
+  zframe_destroy(&header);
+  zframe_destroy(&command);
+  zframe_destroy(&props);
+  zframe_destroy(&service_frame);
+  zmsg_destroy(&msg);
+}
+
+// Takes in the peer's answer to mmi.services:
+// [code][service][queued][workers]...
+// We update the services we are told about and let the others go stale.
+static void
+s_peer_update(peer_t *self, zmsg_t *msg)
+{
+  int64_t expiry = s_wheel_time(self->broker->wheel) + HEARTBEAT_EXPIRY;
+  zframe_t *code = zmsg_pop(msg);
+  int ok = zframe_streq(code, "200");
+  zframe_destroy(&code);
+
+  while (ok && zmsg_size(msg) >= 3) {
+    zframe_t *name = zmsg_pop(msg);
+    char *queued = zmsg_popstr(msg);
+    char *workers = zmsg_popstr(msg);
+    uint32_t hash = s_index_hash(zframe_data(name), zframe_size(name));
+    advert_t *advert = (advert_t *)s_index_lookup(self->services,
+      zframe_data(name), zframe_size(name), hash);
+
+    if (advert == NULL && self->services->size < SERVICE_MAX) {
+      advert = (advert_t *)zmalloc(sizeof(advert_t));
+      advert->name = name;
+      advert->hash = hash;
+      name = NULL;
+      s_index_insert(self->services, zframe_data(advert->name),
+        zframe_size(advert->name), hash, advert);
+    }
+    if (advert) {
+      advert->queued = (size_t) atol(queued);
+      advert->workers = (size_t) atol(workers);
+      advert->forwarded = 0;
+      advert->expiry = expiry;
+    }
+    zframe_destroy(&name);
+    free(queued);
+    free(workers);
+  }
+}
+
+
+// Here is the implementation of the front thread of a sharded broker.
+static front_t *
+s_front_new(settings_t *settings, size_t nbr_shards)
+{
+  front_t *self = (front_t *)zmalloc(sizeof(front_t));
+  self->socket = s_router_new(settings->frontend_hwm);
+  self->backend = self->socket;
+  self->settings = *settings;
+  self->routes = s_index_new();
+  self->gathers = zlist_new();
+
+  //  Pipes to the shards are unbounded, else the front and a shard could
+  //  each block sending to the other. The ROUTER still pushes back. The
+  //  pipe HWM is process wide, so we put back what the application had.
+  size_t pipehwm = zsys_pipehwm();
+  zsys_set_pipehwm(0);
+
+  //  zactor_new returns once the shard has read its settings from us
+  while (self->nbr_shards < nbr_shards) {
+    zactor_t *shard = zactor_new(s_shard_actor, self);
+    self->shards[self->nbr_shards++] = shard;
+  }
+  zsys_set_pipehwm(pipehwm);
+  return self;
+}
+
+static void
+s_front_destroy(front_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    front_t *self = *self_p;
+    for (size_t shard = 0; shard < self->nbr_shards; shard++) {
+      zactor_destroy(&self->shards[shard]);
+    }
+    for (size_t slot = 0; slot < self->routes->limit; slot++) {
+      route_t *route = (route_t *)self->routes->slots[slot].item;
+      if (route) {
+        zframe_destroy(&route->address);
+        free(route);
+      }
+    }
+    s_index_destroy(&self->routes);
+    while (zlist_size(self->gathers)) {
+      gather_t *gather = (gather_t *)zlist_pop(self->gathers);
+      zmsg_destroy(&gather->reply);
+      free(gather);
+    }
+    zlist_destroy(&self->gathers);
+    if (self->backend != self->socket) {
+      zsock_destroy(&self->backend);
+    }
+    zsock_destroy(&self->socket);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+int
+s_front_bind(front_t *self, char *endpoint)
+{
+  if (zsock_bind(self->socket, "%s", endpoint) == -1) {
+    zclock_log("E: cannot bind to %s", endpoint);
+    return -1;
+  }
+  zclock_log("I: MDP broker/0.2.0 is active at %s, %zu shards",
+    endpoint, self->nbr_shards);
+  return 0;
+}
+
+int
+s_front_bind_backend(front_t *self, char *endpoint)
+{
+  if (self->backend == self->socket) {
+    self->backend = s_router_new(self->settings.backend_hwm);
+  }
+  if (zsock_bind(self->backend, "%s", endpoint) == -1) {
+    zclock_log("E: cannot bind to %s", endpoint);
+    return -1;
+  }
+  zclock_log("I: MDP broker/0.2.0 is active for workers at %s", endpoint);
+  return 0;
+}
+
+// The run method passes messages from the ROUTER sockets to the shards and
+// back out again, until it is interrupted or, when embedded, told to
+// terminate. It never looks past the header of a message, and frames are
+// moved between sockets without copying.
+static void
+s_front_run(front_t *self)
+{
+  zmq_pollitem_t items[SHARD_MAX + 3];
+  size_t sockets = self->backend == self->socket? 1: 2;
+  size_t pipe = sockets + self->nbr_shards;
+  items[0] = (zmq_pollitem_t) {zsock_resolve(self->socket), 0, ZMQ_POLLIN, 0};
+  items[1] = (zmq_pollitem_t) {zsock_resolve(self->backend), 0, ZMQ_POLLIN, 0};
+  for (size_t shard = 0; shard < self->nbr_shards; shard++) {
+    items[sockets + shard] = (zmq_pollitem_t) {
+      zsock_resolve(self->shards[shard]), 0, ZMQ_POLLIN, 0
+    };
+  }
+  if (self->pipe) {
+    items[pipe] = (zmq_pollitem_t) {
+      zsock_resolve(self->pipe), 0, ZMQ_POLLIN, 0
+    };
+  }
+  int terminated = 0;
+
+  while (!terminated) {
+    int rc = zmq_poll(items, (int) (self->pipe? pipe + 1: pipe), -1);
+    if (rc == -1) {
+      break;            // Interrupted
+    }
+    if (sockets == 2 && (items[1].revents & ZMQ_POLLIN)) {
+      s_front_drain_socket(self, self->backend);
+    }
+    if (items[0].revents & ZMQ_POLLIN) {
+      s_front_drain_socket(self, self->socket);
+    }
+    for (size_t shard = 0; shard < self->nbr_shards; shard++) {
+      if (items[sockets + shard].revents & ZMQ_POLLIN) {
+        s_front_drain_shard(self, shard);
+      }
+    }
+    if (self->pipe && (items[pipe].revents & ZMQ_POLLIN)) {
+      terminated = s_pipe_terminated(self->pipe);
+    }
+  }
+}
+
+// The drain methods read up to a batch of messages without blocking, from
+// clients and workers or from one shard. If we're interrupted, the next
+// poll tells us. With a separate backend, clients must use the frontend
+// and workers the backend, and what the shards send goes out on the
+// socket for its header.
+static void
+s_front_drain_socket(front_t *self, zsock_t *socket)
+{
+  for (size_t count = 0; count < self->settings.batch; count++) {
+    zmsg_t *msg = s_recv_nowait(socket);
+    if (!msg) {
+      break;            // Drained, or interrupted
+    }
+    zmsg_first(msg);
+    zmsg_next(msg);
+    zframe_t *header = zmsg_next(msg);
+
+    if (zmsg_size(msg) < 4      //  Sender, empty, header, command
+    || (self->backend != self->socket
+    &&  zframe_streq(header, MDPW_WORKER) != (socket == self->backend))) {
+      zclock_log("E: invalid message:");
+      zmsg_dump(msg);
+      zmsg_destroy(&msg);
+    }
+    else {
+      size_t shard = s_front_route(self, msg);
+      if (shard == self->nbr_shards) {
+        //  For every shard
+        for (shard = 1; shard < self->nbr_shards; shard++) {
+          zmsg_t *copy = zmsg_dup(msg);
+          zmsg_send(&copy, self->shards[shard]);
+        }
+        shard = 0;
+      }
+      zmsg_send(&msg, self->shards[shard]);
+    }
+  }
+}
+
+static void
+s_front_drain_shard(front_t *self, size_t shard)
+{
+  for (size_t count = 0; count < self->settings.batch; count++) {
+    zmsg_t *msg = s_recv_nowait(zactor_sock(self->shards[shard]));
+    if (!msg) {
+      break;            // Drained, or interrupted
+    }
+    if (zframe_size(zmsg_first(msg)) == 0) {
+      s_front_forget(self, zmsg_next(msg), shard);
+      zmsg_destroy(&msg);
+      continue;
+    }
+    zsock_t *socket = self->socket;
+    zmsg_next(msg);
+    zframe_t *header = zmsg_next(msg);
+    if (zframe_streq(header, MDPC_CLIENT)) {
+      msg = s_front_gather(self, shard, msg);
+      if (!msg) {
+        continue;       // Waiting for the other shards
+      }
+    }
+    else if (self->backend != self->socket
+         &&  zframe_streq(header, MDPW_WORKER)) {
+      socket = self->backend;
+    }
+    zmsg_send(&msg, socket);
+  }
+}
+
+// The gather method takes a message from a shard to a client. An answer
+// to mmi.services is held until every shard has answered, and then goes
+// out as one reply, with the services of each shard after the first's.
+// Shards answer the requests we copy to them in the order we sent them,
+// so a shard's next answer belongs to the gather it has yet to answer.
+// Returns the message to send on, or NULL if we are holding it.
+static zmsg_t *
+s_front_gather(front_t *self, size_t shard, zmsg_t *msg)
+{
+  zframe_t *command = zmsg_next(msg);
+  zframe_t *service_frame = zmsg_next(msg);
+  if (mdp_props_is(service_frame)) {
+    service_frame = zmsg_next(msg);
+  }
+  if (!zframe_streq(command, MDPC_REPORT)
+  ||  !zframe_streq(service_frame, "mmi.services")) {
+    return msg;
+  }
+  gather_t *gather;
+  if (self->answered[shard] == zlist_size(self->gathers)) {
+    gather = (gather_t *)zmalloc(sizeof(gather_t));
+    zlist_append(self->gathers, gather);
+  }
+  else {
+    gather = (gather_t *)zlist_first(self->gathers);
+    for (size_t index = 0; index < self->answered[shard]; index++) {
+      gather = (gather_t *)zlist_next(self->gathers);
+    }
+  }
+  self->answered[shard]++;
+
+  if (gather->reply == NULL) {
+    gather->reply = msg;
+  }
+  else {
+    //  Drop the envelope and return code, and keep the services
+    zframe_t *frame = zmsg_pop(msg);
+    while (frame != service_frame) {
+      zframe_destroy(&frame);
+      frame = zmsg_pop(msg);
+    }
+    zframe_destroy(&frame);
+    frame = zmsg_pop(msg);
+    zframe_destroy(&frame);
+    while ((frame = zmsg_pop(msg))) {
+      zmsg_append(gather->reply, &frame);
+    }
+    zmsg_destroy(&msg);
+  }
+  if (++gather->answers < self->nbr_shards) {
+    return NULL;
+  }
+  //  Every earlier gather was answered by every shard before this one
+  assert(gather == zlist_first(self->gathers));
+  zlist_pop(self->gathers);
+  for (size_t index = 0; index < self->nbr_shards; index++) {
+    self->answered[index]--;
+  }
+  msg = gather->reply;
+  free(gather);
+  return msg;
+}
+
+// The route method picks the shard for a message from a client or worker.
+// Requests go to the shard of their service, and mmi.service, mmi.queue,
+// mmi.stats, mmi.filter, mmi.coalesce and mmi.cache to the shard of the
+// service they ask about. mmi.services asks every shard, which we show by
+// returning nbr_shards, and the shards' answers are gathered into one
+// reply. A worker is sent to the shard of the service it
+// registers for, and after that by routing id.
+static size_t
+s_front_route(front_t *self, zmsg_t *msg)
+{
+  zframe_t *sender = zmsg_first(msg);
+  zmsg_next(msg);                         //  Empty delimiter
+  zframe_t *header = zmsg_next(msg);
+  zframe_t *frame = zmsg_next(msg);       //  Service name or worker command
+
+  if (zframe_streq(header, MDPW_WORKER)) {
+    uint32_t hash = s_index_hash(zframe_data(sender), zframe_size(sender));
+    route_t *route = (route_t *)s_index_lookup(self->routes,
+      zframe_data(sender), zframe_size(sender), hash);
+
+    if (route) {
+      size_t shard = route->shard;
+      if (zframe_streq(frame, MDPW_DISCONNECT)) {
+        s_front_forget(self, sender, shard);
+      }
+      return shard;
+    }
+    zframe_t *service_frame = zmsg_next(msg);
+    if (zframe_streq(frame, MDPW_READY) && service_frame) {
+      route = (route_t *)zmalloc(sizeof(route_t));
+      route->address = zframe_dup(sender);
+      route->hash = hash;
+      route->shard = s_front_shard(self, service_frame);
+      s_index_insert(self->routes, zframe_data(route->address),
+        zframe_size(route->address), hash, route);
+      return route->shard;
+    }
+    //  Not registered; any shard can turn it away
+    return s_front_shard(self, sender);
+  }
+
+  //  Clients may send props before the service name
+  if (mdp_props_is(frame)) {
+    frame = zmsg_next(msg);
+    if (frame == NULL) {
+      return s_front_shard(self, sender);
+    }
+  }
+  if (zframe_streq(frame, "mmi.services")) {
+    return self->nbr_shards;
+  }
+  if (zframe_streq(frame, "mmi.service")
+       ||  zframe_streq(frame, "mmi.queue")
+       ||  zframe_streq(frame, "mmi.stats")) {
+    frame = zmsg_last(msg);
+  }
+  else if (zframe_streq(frame, "mmi.filter")
+       ||  zframe_streq(frame, "mmi.coalesce")
+       ||  zframe_streq(frame, "mmi.cache")) {
+    zmsg_next(msg);                       //  Operation
+    zframe_t *service_frame = zmsg_next(msg);
+    if (service_frame) {
+      frame = service_frame;
+    }
+  }
+  return s_front_shard(self, frame);
+}
+
+// Maps a name or routing id onto a shard. We take the high bits of the
+// hash, as each shard indexes its services by the low bits.
+static size_t
+s_front_shard(front_t *self, zframe_t *frame)
+{
+  uint32_t hash = s_index_hash(zframe_data(frame), zframe_size(frame));
+  return (size_t) (((uint64_t) hash * self->nbr_shards) >> 32);
+}
+
+// Forgets the route of a worker that a shard deleted. A worker that has
+// already registered again since is left alone.
+static void
+s_front_forget(front_t *self, zframe_t *address, size_t shard)
+{
+  if (address == NULL) {
+    return;
+  }
+  uint32_t hash = s_index_hash(zframe_data(address), zframe_size(address));
+  route_t *route = (route_t *)s_index_lookup(self->routes,
+    zframe_data(address), zframe_size(address), hash);
+
+  if (route && route->shard == shard) {
+    s_index_delete(self->routes, route, hash);
+    zframe_destroy(&route->address);
+    free(route);
+  }
+}
+
+// Each shard runs a broker of its own in an actor thread, which talks to
+// the front thread over its pipe.
+static void
+s_shard_actor(zsock_t *pipe, void *args)
+{
+  front_t *front = (front_t *)args;
+  broker_t *self = s_broker_new(pipe, &front->settings);
+  self->sharded = 1;
+  zsock_signal(pipe, 0);
+
+  s_broker_run(self);
+
+  self->socket = NULL;        //  The pipe belongs to the actor
+  s_broker_destroy(&self);
+}
+
+
+// Finally here is the public API, which lets an application run a broker
+// in its own thread, or embed one and talk to it over inproc://. The
+// broker is set up and bound when it starts, and runs as a front thread
+// and shard threads, or as a single broker, as its settings say.
+struct _mdp_broker_t {
+  settings_t settings;        //  Settings for the broker, or its shards
+  size_t shards;              //  Broker threads, 1 for no front thread
+  zlist_t *endpoints;         //  For clients, and workers
+  zlist_t *backends;          //  For workers only
+  zactor_t *actor;            //  Broker thread, once started
+};
+
+// Creates and binds the broker, then runs it until it is interrupted or,
+// when given a pipe, told to terminate. We report whether the endpoints
+// were bound over the pipe before we start running. Returns 0 if the
+// broker ran, -1 if an endpoint could not be bound.
+static int
+s_mdp_broker_serve(mdp_broker_t *self, zsock_t *pipe)
+{
+  int rc = 0;
+  char *endpoint;
+
+  if (self->shards > 1) {
+    front_t *front = s_front_new(&self->settings, self->shards);
+    front->pipe = pipe;
+    for (endpoint = (char *)zlist_first(self->endpoints);
+         endpoint && rc == 0; endpoint = (char *)zlist_next(self->endpoints)) {
+      rc = s_front_bind(front, endpoint);
+    }
+    for (endpoint = (char *)zlist_first(self->backends);
+         endpoint && rc == 0; endpoint = (char *)zlist_next(self->backends)) {
+      rc = s_front_bind_backend(front, endpoint);
+    }
+    if (pipe) {
+      zsock_signal(pipe, rc == 0? 0: 1);
+    }
+    if (rc == 0) {
+      s_front_run(front);
+    }
+    s_front_destroy(&front);
+  }
+  else {
+    broker_t *broker = s_broker_new(
+      s_router_new(self->settings.frontend_hwm), &self->settings);
+    broker->pipe = pipe;
+    for (endpoint = (char *)zlist_first(self->endpoints);
+         endpoint && rc == 0; endpoint = (char *)zlist_next(self->endpoints)) {
+      rc = s_broker_bind(broker, endpoint);
+    }
+    for (endpoint = (char *)zlist_first(self->backends);
+         endpoint && rc == 0; endpoint = (char *)zlist_next(self->backends)) {
+      rc = s_broker_bind_backend(broker, endpoint, self->settings.backend_hwm);
+    }
+    if (pipe) {
+      zsock_signal(pipe, rc == 0? 0: 1);
+    }
+    if (rc == 0) {
+      s_broker_run(broker);
+    }
+    s_broker_destroy(&broker);
+  }
+  return rc;
+}
+
+// ---------------------------------------------------------------------
+// Constructor
+
+mdp_broker_t *
+mdp_broker_new(int verbose)
+{
+  mdp_broker_t *self = (mdp_broker_t *)zmalloc(sizeof(mdp_broker_t));
+  self->settings.verbose = verbose;
+  self->settings.max_inflight = WORKER_MAX_INFLIGHT;
+  self->settings.batch = BROKER_BATCH;
+  self->settings.queue_max = QUEUE_MAX;
+  self->settings.queue_bytes_max = QUEUE_BYTES_MAX;
+  self->settings.total_max = TOTAL_MAX;
+  self->settings.total_bytes_max = TOTAL_BYTES_MAX;
+  self->settings.overflow = OVERFLOW_NAK;
+  self->settings.cache_bytes_max = CACHE_BYTES_MAX;
+  self->settings.max_reissues = WORKER_REISSUES;
+  self->shards = 1;
+  self->endpoints = zlist_new();
+  zlist_autofree(self->endpoints);
+  self->backends = zlist_new();
+  zlist_autofree(self->backends);
+  return self;
+}
+
+// ---------------------------------------------------------------------
+// Destructor, stops the broker if it is running
+
+void
+mdp_broker_destroy(mdp_broker_t **self_p)
+{
+  assert(self_p);
+  if (*self_p) {
+    mdp_broker_t *self = *self_p;
+    mdp_broker_stop(self);
+    for (size_t index = 0; index < self->settings.nbr_peers; index++) {
+      free(self->settings.peers[index]);
+    }
+    zlist_destroy(&self->endpoints);
+    zlist_destroy(&self->backends);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Set requests in flight per worker; takes effect at the next start
+
+void
+mdp_broker_set_max_inflight(mdp_broker_t *self, size_t max_inflight)
+{
+  self->settings.max_inflight = max_inflight < 1? 1: max_inflight;
+}
+
+// ---------------------------------------------------------------------
+// Set number of broker threads; with more than one, services are split
+// across them by name, and mmi.services still lists them all
+
+void
+mdp_broker_set_shards(mdp_broker_t *self, size_t shards)
+{
+  self->shards = shards < 1? 1: shards > SHARD_MAX? SHARD_MAX: shards;
+}
+
+// ---------------------------------------------------------------------
+// Set messages read per wakeup
+
+void
+mdp_broker_set_batch(mdp_broker_t *self, size_t batch)
+{
+  self->settings.batch = batch < 1? 1: batch;
+}
+
+// ---------------------------------------------------------------------
+// Set requests and bytes queued per service, and in all; 0 means no
+// limit. With several shards the totals apply per shard.
+
+void
+mdp_broker_set_queue_limits(mdp_broker_t *self, size_t queue_max,
+  size_t queue_bytes_max, size_t total_max, size_t total_bytes_max)
+{
+  self->settings.queue_max = queue_max;
+  self->settings.queue_bytes_max = queue_bytes_max;
+  self->settings.total_max = total_max;
+  self->settings.total_bytes_max = total_bytes_max;
+}
+
+// ---------------------------------------------------------------------
+// Set what to do with a request for a full queue: "nak", "drop-oldest"
+// or "drop-newest". Returns 0 if OK, -1 if the policy is unknown.
+
+int
+mdp_broker_set_overflow(mdp_broker_t *self, const char *policy)
+{
+  if (streq(policy, "nak")) {
+    self->settings.overflow = OVERFLOW_NAK;
+  }
+  else if (streq(policy, "drop-oldest")) {
+    self->settings.overflow = OVERFLOW_DROP_OLDEST;
+  }
+  else if (streq(policy, "drop-newest")) {
+    self->settings.overflow = OVERFLOW_DROP_NEWEST;
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Set HWM of the client and worker sockets, 0 for the default
+
+void
+mdp_broker_set_hwm(mdp_broker_t *self, int frontend_hwm, int backend_hwm)
+{
+  self->settings.frontend_hwm = frontend_hwm;
+  self->settings.backend_hwm = backend_hwm;
+}
+
+// ---------------------------------------------------------------------
+// Set how many times a request may be sent to another worker, after the
+// worker it went to died on it; after that the client gets a NAK. 0 means
+// never, which also frees each request as soon as it goes out, rather
+// than holding it until its worker reports.
+
+void
+mdp_broker_set_reissue(mdp_broker_t *self, size_t max_reissues)
+{
+  self->settings.max_reissues = max_reissues;
+}
+
+// ---------------------------------------------------------------------
+// Set the memory for reports cached by mmi.cache, 0 to cache nothing.
+// In sharded mode each shard has this much.
+
+void
+mdp_broker_set_cache(mdp_broker_t *self, size_t cache_bytes_max)
+{
+  self->settings.cache_bytes_max = cache_bytes_max;
+}
+
+// ---------------------------------------------------------------------
+// Get the settings above, which hold their defaults until they are set
+
+size_t
+mdp_broker_max_inflight(mdp_broker_t *self)
+{
+  return self->settings.max_inflight;
+}
+
+size_t
+mdp_broker_batch(mdp_broker_t *self)
+{
+  return self->settings.batch;
+}
+
+void
+mdp_broker_queue_limits(mdp_broker_t *self, size_t *queue_max_p,
+  size_t *queue_bytes_max_p, size_t *total_max_p, size_t *total_bytes_max_p)
+{
+  *queue_max_p = self->settings.queue_max;
+  *queue_bytes_max_p = self->settings.queue_bytes_max;
+  *total_max_p = self->settings.total_max;
+  *total_bytes_max_p = self->settings.total_bytes_max;
+}
+
+size_t
+mdp_broker_reissue(mdp_broker_t *self)
+{
+  return self->settings.max_reissues;
+}
+
+size_t
+mdp_broker_cache(mdp_broker_t *self)
+{
+  return self->settings.cache_bytes_max;
+}
+
+// ---------------------------------------------------------------------
+// Add an endpoint for clients, and for workers unless the broker has a
+// backend. Endpoints are bound when the broker starts. Returns 0 if OK,
+// -1 if the broker is already running.
+
+int
+mdp_broker_bind(mdp_broker_t *self, const char *endpoint)
+{
+  if (self->actor) {
+    return -1;
+  }
+  zlist_append(self->endpoints, (void *)endpoint);
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Add an endpoint for workers only. Once a broker has one, workers must
+// use its backend endpoints and clients the others. Returns 0 if OK, -1
+// if the broker is already running.
+
+int
+mdp_broker_bind_backend(mdp_broker_t *self, const char *endpoint)
+{
+  if (self->actor) {
+    return -1;
+  }
+  zlist_append(self->backends, (void *)endpoint);
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Add a peer broker, given by its client endpoint. Requests for services
+// we have no workers for go to a peer that has, sharing load by queue
+// depth. Returns 0 if OK, -1 if the broker is running or has PEER_MAX
+// peers already.
+
+int
+mdp_broker_peer(mdp_broker_t *self, const char *endpoint)
+{
+  if (self->actor || self->settings.nbr_peers == PEER_MAX) {
+    return -1;
+  }
+  self->settings.peers[self->settings.nbr_peers++] = strdup(endpoint);
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Start the broker in a thread of its own, and return once its endpoints
+// are bound. Returns 0 if OK, -1 if it is already running or an endpoint
+// could not be bound.
+
+int
+mdp_broker_start(mdp_broker_t *self)
+{
+  if (self->actor) {
+    return -1;
+  }
+  self->actor = zactor_new(mdp_broker_actor, self);
+  if (zsock_wait(self->actor) != 0) {
+    zactor_destroy(&self->actor);
+    return -1;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Stop a broker started with mdp_broker_start, and wait for its thread
+// to finish. Requests still queued are lost.
+
+void
+mdp_broker_stop(mdp_broker_t *self)
+{
+  zactor_destroy(&self->actor);
+}
+
+// ---------------------------------------------------------------------
+// Run the broker in the calling thread until it is interrupted. Returns
+// 0 if OK, -1 if it is already running or an endpoint could not be bound.
+
+int
+mdp_broker_run(mdp_broker_t *self)
+{
+  if (self->actor) {
+    return -1;
+  }
+  return s_mdp_broker_serve(self, NULL);
+}
+
+// ---------------------------------------------------------------------
+// Actor that runs the broker given as args, as mdp_broker_start does.
+// Once zactor_new returns, the actor signals 0 when its endpoints are
+// bound, or 1 if one could not be bound, and then stops on $TERM.
+
+void
+mdp_broker_actor(zsock_t *pipe, void *args)
+{
+  mdp_broker_t *self = (mdp_broker_t *)args;
+  zsock_signal(pipe, 0);
+  s_mdp_broker_serve(self, pipe);
+}
@@ -0,0 +1,89 @@
+/*  =========================================================================
+    mdp_broker.h - broker API
+
+    -------------------------------------------------------------------------
+    Copyright (c) 1991-2012 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of the Majordomo Project: http://majordomo.zeromq.org,
+    an implementation of rfc.zeromq.org/spec:18/MDP (MDP/0.2) in C.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 3 of the License, or (at your
+    option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program. If not, see <http://www.gnu.org/licenses/>.
+    =========================================================================
+*/
+
+#ifndef __MDP_BROKER_H_INCLUDED__
+#define __MDP_BROKER_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structure
+typedef struct _mdp_broker_t mdp_broker_t;
+
+//  @interface
+CZMQ_EXPORT mdp_broker_t *
+  mdp_broker_new(int verbose);
+CZMQ_EXPORT void
+  mdp_broker_destroy(mdp_broker_t **self_p);
+CZMQ_EXPORT void
+  mdp_broker_set_max_inflight(mdp_broker_t *self, size_t max_inflight);
+CZMQ_EXPORT void
+  mdp_broker_set_shards(mdp_broker_t *self, size_t shards);
+CZMQ_EXPORT void
+  mdp_broker_set_batch(mdp_broker_t *self, size_t batch);
+CZMQ_EXPORT void
+  mdp_broker_set_queue_limits(mdp_broker_t *self, size_t queue_max,
+    size_t queue_bytes_max, size_t total_max, size_t total_bytes_max);
+CZMQ_EXPORT int
+  mdp_broker_set_overflow(mdp_broker_t *self, const char *policy);
+CZMQ_EXPORT void
+  mdp_broker_set_hwm(mdp_broker_t *self, int frontend_hwm, int backend_hwm);
+CZMQ_EXPORT void
+  mdp_broker_set_reissue(mdp_broker_t *self, size_t max_reissues);
+CZMQ_EXPORT void
+  mdp_broker_set_cache(mdp_broker_t *self, size_t cache_bytes_max);
+CZMQ_EXPORT size_t
+  mdp_broker_max_inflight(mdp_broker_t *self);
+CZMQ_EXPORT size_t
+  mdp_broker_batch(mdp_broker_t *self);
+CZMQ_EXPORT void
+  mdp_broker_queue_limits(mdp_broker_t *self, size_t *queue_max_p,
+    size_t *queue_bytes_max_p, size_t *total_max_p, size_t *total_bytes_max_p);
+CZMQ_EXPORT size_t
+  mdp_broker_reissue(mdp_broker_t *self);
+CZMQ_EXPORT size_t
+  mdp_broker_cache(mdp_broker_t *self);
+CZMQ_EXPORT int
+  mdp_broker_bind(mdp_broker_t *self, const char *endpoint);
+CZMQ_EXPORT int
+  mdp_broker_bind_backend(mdp_broker_t *self, const char *endpoint);
+CZMQ_EXPORT int
+  mdp_broker_peer(mdp_broker_t *self, const char *endpoint);
+CZMQ_EXPORT int
+  mdp_broker_start(mdp_broker_t *self);
+CZMQ_EXPORT void
+  mdp_broker_stop(mdp_broker_t *self);
+CZMQ_EXPORT int
+  mdp_broker_run(mdp_broker_t *self);
+CZMQ_EXPORT void
+  mdp_broker_actor(zsock_t *pipe, void *args);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
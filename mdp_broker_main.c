@@ -0,0 +1,217 @@
+/*  =========================================================================
+    mdp_broker_main.c - Majordomo Protocol broker daemon
+
+    -------------------------------------------------------------------------
+    Copyright (c) 1991-2012 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of the Majordomo Project: http://majordomo.zeromq.org,
+    an implementation of rfc.zeromq.org/spec:18/MDP (MDP/0.2) in C.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 3 of the License, or (at your
+    option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program. If not, see <http://www.gnu.org/licenses/>.
+    =========================================================================
+*/
+
+#include <unistd.h>
+#include "mdp.h"
+
+#define ENDPOINT_MAX        16      //  Endpoints bound per socket
+
+// Prints how to run the broker, with the library's defaults
+static void
+s_usage(char *program)
+{
+  mdp_broker_t *broker = mdp_broker_new(0);
+  size_t queue_max, queue_bytes_max, total_max, total_bytes_max;
+  mdp_broker_queue_limits(broker, &queue_max, &queue_bytes_max,
+    &total_max, &total_bytes_max);
+
+  printf("%s [-h] | [-d] [-v] [-c count] [-s shards] [-b batch] [-q count] [-Q bytes] [-t count] [-T bytes] [-o policy] [-r count] [-C bytes] [-w worker url]... [-p peer url]... [-F hwm] [-B hwm] [broker url]...\n"
+    "\t-h This help message\n"
+    "\t-d Daemon mode.\n"
+    "\t-v Verbose output\n"
+    "\t-c Requests in flight per worker, defaults to %zu\n"
+    "\t-s Broker threads, defaults to 1\n"
+    "\t-b Messages read per wakeup, defaults to %zu\n"
+    "\t-q Requests queued per service, defaults to %zu\n"
+    "\t-Q Bytes queued per service, defaults to %zu\n"
+    "\t-t Requests queued in all, defaults to %zu\n"
+    "\t-T Bytes queued in all, defaults to %zu\n"
+    "\t-o Full queue policy: nak, drop-oldest or drop-newest, defaults to nak\n"
+    "\tQueue limits of 0 mean no limit; with -s they apply per thread\n"
+    "\t-r Times a request goes to another worker if its worker dies, defaults to %zu\n"
+    "\t-C Memory for cached reports, defaults to %zu, 0 for no cache\n"
+    "\t-w Bind a separate socket for workers; clients use the broker urls\n"
+    "\t-p Forward requests for services without workers to this broker\n"
+    "\t-F HWM of the client socket\n"
+    "\t-B HWM of the worker socket\n"
+    "\tbroker url defaults to tcp://*:5555; any url may be tcp, ipc or inproc\n",
+    program, mdp_broker_max_inflight(broker), mdp_broker_batch(broker),
+    queue_max, queue_bytes_max, total_max, total_bytes_max,
+    mdp_broker_reissue(broker), mdp_broker_cache(broker));
+  mdp_broker_destroy(&broker);
+}
+
+// Here is the main task. We set up a broker from the command line, and
+// run it in this thread until we are interrupted. With more than one shard
+// the broker runs as a front thread and that many broker threads. Options
+// that are not given keep the library's defaults.
+int main(int argc, char *argv[])
+{
+  int daemonize = 0;
+  int verbose = 0;
+  int shards = 1;
+  char *max_inflight = NULL;
+  char *batch = NULL;
+  char *queue_max = NULL;
+  char *queue_bytes_max = NULL;
+  char *total_max = NULL;
+  char *total_bytes_max = NULL;
+  char *overflow = NULL;
+  char *cache_bytes_max = NULL;
+  char *max_reissues = NULL;
+  int frontend_hwm = 0;
+  int backend_hwm = 0;
+  char *endpoints[ENDPOINT_MAX];      //  For clients, and workers
+  size_t nbr_endpoints = 0;
+  char *backends[ENDPOINT_MAX];       //  For workers only
+  size_t nbr_backends = 0;
+  char *peers[ENDPOINT_MAX];          //  Brokers to forward to
+  size_t nbr_peers = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "-v")) {
+      verbose = 1;
+    }
+    else if (streq(argv[i], "-d")) {
+      daemonize = 1;
+    }
+    else if (streq(argv[i], "-c") && i + 1 < argc) {
+      max_inflight = argv[++i];
+    }
+    else if (streq(argv[i], "-s") && i + 1 < argc) {
+      shards = atoi(argv[++i]);
+    }
+    else if (streq(argv[i], "-b") && i + 1 < argc) {
+      batch = argv[++i];
+    }
+    else if (streq(argv[i], "-q") && i + 1 < argc) {
+      queue_max = argv[++i];
+    }
+    else if (streq(argv[i], "-Q") && i + 1 < argc) {
+      queue_bytes_max = argv[++i];
+    }
+    else if (streq(argv[i], "-t") && i + 1 < argc) {
+      total_max = argv[++i];
+    }
+    else if (streq(argv[i], "-T") && i + 1 < argc) {
+      total_bytes_max = argv[++i];
+    }
+    else if (streq(argv[i], "-o") && i + 1 < argc) {
+      overflow = argv[++i];
+    }
+    else if (streq(argv[i], "-r") && i + 1 < argc) {
+      max_reissues = argv[++i];
+    }
+    else if (streq(argv[i], "-C") && i + 1 < argc) {
+      cache_bytes_max = argv[++i];
+    }
+    else if (streq(argv[i], "-w") && i + 1 < argc) {
+      if (nbr_backends < ENDPOINT_MAX) {
+        backends[nbr_backends++] = argv[i + 1];
+      }
+      i++;
+    }
+    else if (streq(argv[i], "-p") && i + 1 < argc) {
+      if (nbr_peers < ENDPOINT_MAX) {
+        peers[nbr_peers++] = argv[i + 1];
+      }
+      else {
+        printf("W: too many peers, not forwarding to %s\n", argv[i + 1]);
+      }
+      i++;
+    }
+    else if (streq(argv[i], "-F") && i + 1 < argc) {
+      frontend_hwm = atoi(argv[++i]);
+    }
+    else if (streq(argv[i], "-B") && i + 1 < argc) {
+      backend_hwm = atoi(argv[++i]);
+    }
+    else if (streq(argv[i], "-h")) {
+      s_usage(argv[0]);
+      return -1;
+    }
+    else if (nbr_endpoints < ENDPOINT_MAX) {
+      endpoints[nbr_endpoints++] = argv[i];
+    }
+  }
+  if (nbr_endpoints == 0) {
+    endpoints[nbr_endpoints++] = "tcp://*:5555";
+  }
+
+  mdp_broker_t *broker = mdp_broker_new(verbose);
+  if (overflow && mdp_broker_set_overflow(broker, overflow) == -1) {
+    printf("E: unknown full queue policy: %s\n", overflow);
+    s_usage(argv[0]);
+    mdp_broker_destroy(&broker);
+    return -1;
+  }
+  if (max_inflight) {
+    mdp_broker_set_max_inflight(broker, (size_t) atol(max_inflight));
+  }
+  mdp_broker_set_shards(broker, shards < 1? 1: (size_t) shards);
+  if (batch) {
+    mdp_broker_set_batch(broker, (size_t) atol(batch));
+  }
+  if (queue_max || queue_bytes_max || total_max || total_bytes_max) {
+    size_t limits[4];
+    mdp_broker_queue_limits(broker, &limits[0], &limits[1],
+      &limits[2], &limits[3]);
+    mdp_broker_set_queue_limits(broker,
+      queue_max? (size_t) atol(queue_max): limits[0],
+      queue_bytes_max? (size_t) atol(queue_bytes_max): limits[1],
+      total_max? (size_t) atol(total_max): limits[2],
+      total_bytes_max? (size_t) atol(total_bytes_max): limits[3]);
+  }
+  mdp_broker_set_hwm(broker, frontend_hwm, backend_hwm);
+  if (max_reissues) {
+    mdp_broker_set_reissue(broker, (size_t) atol(max_reissues));
+  }
+  if (cache_bytes_max) {
+    mdp_broker_set_cache(broker, (size_t) atol(cache_bytes_max));
+  }
+  for (size_t index = 0; index < nbr_endpoints; index++) {
+    mdp_broker_bind(broker, endpoints[index]);
+  }
+  for (size_t index = 0; index < nbr_backends; index++) {
+    mdp_broker_bind_backend(broker, backends[index]);
+  }
+  for (size_t index = 0; index < nbr_peers; index++) {
+    if (mdp_broker_peer(broker, peers[index]) == -1) {
+      printf("W: too many peers, not forwarding to %s\n", peers[index]);
+    }
+  }
+
+  if (daemonize != 0) {
+    int rc = daemon(0, 0);
+    assert(rc == 0);
+  }
+
+  int rc = mdp_broker_run(broker);
+  if (zctx_interrupted) {
+    printf("W: interrupt received, shutting down...\n");
+  }
+  mdp_broker_destroy(&broker);
+  return rc;
+}
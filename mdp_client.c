@@ -25,6 +25,26 @@
 
 #include "mdp_common.h"
 #include "mdp_client.h"
+#include "mdp_props.h"
+
+#define MDP_CLIENT_WINDOW   256     //  Default requests in flight at once
+#define MDP_CLIENT_SAMPLES  128     //  Latencies we keep to pick a hedge delay
+#define MDP_CLIENT_RESAMPLE 16      //  New latencies before we pick it again
+#define MDP_CLIENT_TOKEN    1000    //  A retry or hedge, in budget units
+
+//  A request that is waiting for its reply. It sits in the slot of the
+//  window given by its id, modulo the window size.
+typedef struct {
+  uint32_t id;                //  Request id, or 0 if the slot is free
+  int64_t deadline;           //  When we give up on this try, or 0 for never
+  int64_t hedge_at;           //  When to send a hedge, or 0 for never
+  int64_t sent_at;            //  When we first sent it
+  int retries;                //  Retries left
+  char *service;              //  Service it is for
+  zmsg_t *request;            //  Copy to send again, if we may
+  mdp_client_fn *callback;    //  Gets the reply, or NULL for mdp_client_poll
+  void *args;                 //  Argument for the callback
+} pending_t;
 
 //  Structure of our class
 //  We access these properties only via class methods
@@ -33,6 +53,29 @@ struct _mdp_client_t {
   zsock_t *client;            //  Socket to broker
   int verbose;                //  Print activity to stdout
   int timeout;                //  Request timeout
+  int priority;               //  Priority class, or -1 for the default
+  int key_frame;              //  Body frame holding the key, or -1 for none
+
+  //  Requests in flight
+  pending_t *pending;         //  Window of slots, made on first use
+  size_t window;              //  Slots in the window
+  size_t inflight;            //  Slots in use
+  uint32_t next_id;           //  Id to try next; 0 is never used
+  int64_t timer_at;           //  Earliest deadline or hedge time, or 0
+  zlist_t *ready;             //  Replies waiting for mdp_client_poll, as
+                              //  [id][command][service][body]
+  uint32_t sync_id;           //  Request of mdp_client_send, or 0
+
+  //  Retries and hedges, which cost tokens from a budget that each new
+  //  request adds a fraction of a token to
+  int retries;                //  Times to send a request again on timeout
+  int hedge;                  //  Latency percentile to hedge after, or 0
+  int hedge_delay;            //  That percentile, msecs, or 0 if unknown
+  int latencies[MDP_CLIENT_SAMPLES];
+  size_t samples;             //  Latencies we have taken, in all
+  int64_t tokens;             //  Budget left, in units of 1/1000 token
+  int64_t token_rate;         //  Units each new request adds
+  int64_t token_max;          //  Units the budget holds at most
 };
 
 
@@ -50,8 +93,6 @@ void s_mdp_client_connect_to_broker (mdp_client_t *self)
   if (self->verbose) {
     zclock_log("I: connecting to broker at %s...", self->broker);
   }
-
-  zsock_set_rcvtimeo(self->client,self->timeout);
 }
 
 
@@ -66,6 +107,14 @@ mdp_client_new(char *broker, int verbose)
   self->broker = strdup(broker);
   self->verbose = verbose;
   self->timeout = 2500;        // msecs
+  self->priority = -1;
+  self->key_frame = -1;
+  self->window = MDP_CLIENT_WINDOW;
+  self->next_id = 1;
+  self->ready = zlist_new();
+  self->token_rate = MDP_CLIENT_TOKEN / 10;
+  self->token_max = 10 * MDP_CLIENT_TOKEN;
+  self->tokens = self->token_max;
 
   s_mdp_client_connect_to_broker(self);
   return self;
@@ -81,6 +130,16 @@ mdp_client_destroy(mdp_client_t **self_p)
   if (*self_p) {
     mdp_client_t *self = *self_p;
     zsock_destroy(&self->client);
+    while (zlist_size(self->ready)) {
+      zmsg_t *reply = (zmsg_t *)zlist_pop(self->ready);
+      zmsg_destroy(&reply);
+    }
+    zlist_destroy(&self->ready);
+    for (size_t index = 0; self->pending && index < self->window; index++) {
+      free(self->pending[index].service);
+      zmsg_destroy(&self->pending[index].request);
+    }
+    free(self->pending);
     free(self->broker);
     free(self);
     *self_p = NULL;
@@ -88,14 +147,100 @@ mdp_client_destroy(mdp_client_t **self_p)
 }
 
 // ---------------------------------------------------------------------
-// Set request timeout
+// Set request timeout, in msecs. It sets the deadline of each request we
+// send from now on, and the budget the broker and worker are told; the
+// socket itself has no timeout, as we only read from it once polled.
 
 void
 mdp_client_set_timeout(mdp_client_t *self, int timeout)
 {
   assert(self);
   self->timeout = timeout;
-  zsock_set_rcvtimeo(self->client, self->timeout);
+}
+
+// ---------------------------------------------------------------------
+// Set the priority class of requests; 0 is the most urgent. The broker
+// queues each class apart and gives it a weighted share of the workers.
+// Pass -1 to go back to the broker's default class.
+
+void
+mdp_client_set_priority(mdp_client_t *self, int priority)
+{
+  assert(self);
+  self->priority = priority;
+}
+
+// ---------------------------------------------------------------------
+// Set which frame of the request body holds its affinity key, such as a
+// material or PO number, counting from 0. The broker sends requests with
+// the same key to the same worker, as long as it has capacity, so caches
+// in workers pay off. Pass -1 to let the broker pick any worker.
+
+void
+mdp_client_set_key_frame(mdp_client_t *self, int key_frame)
+{
+  assert(self);
+  self->key_frame = key_frame;
+}
+
+// ---------------------------------------------------------------------
+// Set how many requests may be in flight at once. Call it
+// before the first mdp_client_request.
+
+void
+mdp_client_set_window(mdp_client_t *self, size_t window)
+{
+  assert(self);
+  assert(window > 0);
+  assert(self->inflight == 0);
+  free(self->pending);
+  self->pending = NULL;
+  self->window = window;
+}
+
+// ---------------------------------------------------------------------
+// Set how many times to send a request again when it gets no reply within
+// the timeout, in the manner of the Lazy Pirate pattern. Only turn this on
+// for sessions whose requests are safe to repeat, such as reads.
+
+void
+mdp_client_set_retries(mdp_client_t *self, int retries)
+{
+  assert(self);
+  self->retries = retries;
+}
+
+// ---------------------------------------------------------------------
+// Set a latency percentile, such as 95, past which a request is hedged:
+// sent again, to any worker, while we keep waiting for the first reply,
+// and the first reply wins. This cuts the tail of latency for reads. Pass
+// 0 to turn hedging off, which is the default.
+
+void
+mdp_client_set_hedge(mdp_client_t *self, int percentile)
+{
+  assert(self);
+  assert(percentile >= 0 && percentile < 100);
+  self->hedge = percentile;
+  self->hedge_delay = 0;
+}
+
+// ---------------------------------------------------------------------
+// Set the budget for retries and hedges: each new request earns percent
+// of a retry, and up to burst retries can be saved up. When the budget is
+// spent, requests time out rather than being sent again, so retries
+// cannot multiply the load on a broker that is already in trouble. The
+// default is 10 percent, and a burst of 10.
+
+void
+mdp_client_set_retry_budget(mdp_client_t *self, int percent, int burst)
+{
+  assert(self);
+  self->token_rate = (int64_t) percent * MDP_CLIENT_TOKEN / 100;
+  self->token_max = (int64_t) burst * MDP_CLIENT_TOKEN;
+  if (self->tokens > self->token_max) {
+    self->tokens = self->token_max;
+  }
 }
 
 // ---------------------------------------------------------------------
@@ -119,20 +264,44 @@ mdp_client_getsockopt(mdp_client_t *self, int option, void *optval, size_t *optv
   return zmq_getsockopt(zsock_resolve(self->client), option, optval, optvallen);
 }
 
-// Here is the send method. It sends a request to the broker.
-// It takes ownership of the request message, and destroys it when sent.
-void
-mdp_client_send (mdp_client_t *self, char *service, zmsg_t **request_p)
+// The send method stacks the protocol envelope on a request and sends it
+// to the broker. A non-zero id goes in the props, for the broker to echo.
+// Retries and hedges are not keyed, so they may go to another worker.
+static void
+s_mdp_client_send(mdp_client_t *self, char *service, zmsg_t **request_p,
+  uint32_t id, int keyed)
 {
-  assert(self);
   assert(request_p);
   zmsg_t *request = *request_p;
 
   // Prefix request with protocol frames
   // Frame 1: empty frame (delimiter)
   // Frame 2: "MDPCxy" (six bytes, MDP/Client x.y)
-  // Frame 3: Service name (printable string)
+  // Frame 3: Props, with the time we will wait for a reply, if we have
+  //          a timeout; the broker drops the request once it runs out.
+  //          Also the priority class of the request, the body frame
+  //          holding its affinity key, and the request id, if set.
+  // Frame 4: Service name (printable string)
   zmsg_pushstr(request, service);
+  keyed = keyed && self->key_frame >= 0;
+  if (self->timeout > 0 || self->priority >= 0 || keyed || id) {
+    mdp_props_t props;
+    mdp_props_init(&props);
+    if (self->timeout > 0) {
+      mdp_props_put_number(&props, MDP_PROPS_BUDGET, (uint32_t) self->timeout);
+    }
+    if (self->priority >= 0) {
+      mdp_props_put_number(&props, MDP_PROPS_PRIORITY, (uint32_t) self->priority);
+    }
+    if (keyed) {
+      mdp_props_put_number(&props, MDP_PROPS_KEY, (uint32_t) self->key_frame);
+    }
+    if (id) {
+      mdp_props_put_number(&props, MDP_PROPS_REQUEST, id);
+    }
+    zframe_t *frame = mdp_props_frame(&props);
+    zmsg_prepend(request, &frame);
+  }
   zmsg_pushstr(request, MDPC_CLIENT);
   zmsg_pushstr(request, "");
   if (self->verbose) {
@@ -142,21 +311,12 @@ mdp_client_send (mdp_client_t *self, char *service, zmsg_t **request_p)
   zmsg_send(request_p, self->client);
 }
 
-// Receive report from the broker.
-// The caller is responsible for destroying the received message.
-// If service is not NULL, it is filled in with a pointer
-// to service string. It is caller's responsibility to free it.
-
-zmsg_t *
-mdp_client_recv(mdp_client_t *self, char **command_p, char **service_p)
+// The unwrap method takes the envelope off a reply from the broker, and
+// returns the request id it echoes, or 0 if it has none.
+static uint32_t
+s_mdp_client_unwrap(mdp_client_t *self, zmsg_t *msg, char **command_p,
+  char **service_p)
 {
-  assert(self);
-
-  zmsg_t *msg = zmsg_recv(self->client);
-  if (msg == NULL) {
-    return NULL;   //  Interrupt
-  }
-
   if (self->verbose) {
     zclock_log("I: received reply:");
     zmsg_dump(msg);
@@ -166,8 +326,13 @@ mdp_client_recv(mdp_client_t *self, char **command_p, char **service_p)
   // Frame 1: empty frame (delimiter)
   // Frame 2: "MDPCxy" (six bytes, MDP/Client x.y)
   // Frame 3: REPORT|NAK
-  // Frame 4: Service name (printable string)
-  // Frame 5..n: Application frames
+  // Frame 4: Props, if the broker echoes any, such as the request id
+  // Frame 5: Service name (printable string)
+  // Frame 6..n: Application frames. A NAK starts with a status code:
+  //   "403" the command is disabled, "404" the service went away,
+  //   "503" the broker is busy, so back off before trying again,
+  //   "500" workers kept dying on the request, and for requests sent
+  //   with mdp_client_request, "504" we gave up waiting for the reply
 
   // We would handle malformed replies better in real code
   assert(zmsg_size(msg) >= 5);
@@ -188,11 +353,406 @@ mdp_client_recv(mdp_client_t *self, char **command_p, char **service_p)
   }
   zframe_destroy(&command);
 
+  uint32_t id = 0;
+  if (mdp_props_is(zmsg_first(msg))) {
+    zframe_t *props = zmsg_pop(msg);
+    id = (uint32_t) mdp_props_get_number(props, MDP_PROPS_REQUEST, 0);
+    zframe_destroy(&props);
+  }
+
   zframe_t *service = zmsg_pop(msg);
   if (service_p) {
     *service_p = zframe_strdup(service);
   }
   zframe_destroy(&service);
+  return id;
+}
+
+// Here is the engine of the client API. Each request gets an id that the
+// broker echoes in its reply, so many requests can be in flight on one
+// session and complete in any order. The reply goes to the request's
+// callback, or waits for mdp_client_poll or mdp_client_recv. A request
+// that gets no reply within the timeout is sent again if we may, else it
+// completes with a NAK "504". A request that is slower than most may be
+// hedged. The first reply to a request wins; we drop any later ones.
+
+// Takes a token from the retry budget, if there is one
+static int
+s_mdp_client_spend(mdp_client_t *self)
+{
+  if (self->tokens < MDP_CLIENT_TOKEN) {
+    return 0;
+  }
+  self->tokens -= MDP_CLIENT_TOKEN;
+  return 1;
+}
+
+// Sends a request again, for a retry or a hedge
+static void
+s_mdp_client_resend(mdp_client_t *self, pending_t *slot)
+{
+  zmsg_t *request = zmsg_dup(slot->request);
+  s_mdp_client_send(self, slot->service, &request, slot->id, 0);
+}
+
+// Takes the latency of a request, and every so often picks the hedge
+// delay again from the latencies we have
+static void
+s_mdp_client_sample(mdp_client_t *self, int latency)
+{
+  self->latencies[self->samples++ % MDP_CLIENT_SAMPLES] = latency;
+  if (self->hedge && self->samples % MDP_CLIENT_RESAMPLE == 0) {
+    size_t count = self->samples < MDP_CLIENT_SAMPLES?
+      self->samples: MDP_CLIENT_SAMPLES;
+    int sorted[MDP_CLIENT_SAMPLES];
+    memcpy(sorted, self->latencies, count * sizeof(int));
+    //  Insertion sort, as there are few of them
+    for (size_t index = 1; index < count; index++) {
+      int value = sorted[index];
+      size_t place = index;
+      for (; place > 0 && sorted[place - 1] > value; place--) {
+        sorted[place] = sorted[place - 1];
+      }
+      sorted[place] = value;
+    }
+    self->hedge_delay = sorted[count * self->hedge / 100];
+    if (self->hedge_delay < 1) {
+      self->hedge_delay = 1;
+    }
+  }
+}
 
+// Notes that a timer is due, so we wake up for it
+static void
+s_mdp_client_timer(mdp_client_t *self, int64_t when)
+{
+  if (when && (self->timer_at == 0 || when < self->timer_at)) {
+    self->timer_at = when;
+  }
+}
+
+// Completes a request: frees its slot, then hands the reply on. The slot
+// is free before the callback runs, so it can send another request.
+static void
+s_mdp_client_complete(mdp_client_t *self, pending_t *slot, char *command,
+  zmsg_t **reply_p)
+{
+  uint32_t id = slot->id;
+  char *service = slot->service;
+  mdp_client_fn *callback = slot->callback;
+  void *args = slot->args;
+  if (streq(command, MDPC_REPORT)) {
+    s_mdp_client_sample(self, (int) (zclock_mono() - slot->sent_at));
+  }
+  slot->id = 0;
+  slot->service = NULL;
+  zmsg_destroy(&slot->request);
+  self->inflight--;
+
+  if (callback) {
+    (callback)(self, id, command, reply_p, args);
+    zmsg_destroy(reply_p);
+  }
+  else {
+    zmsg_pushstr(*reply_p, service);
+    zmsg_pushstr(*reply_p, command);
+    zmsg_pushmem(*reply_p, &id, sizeof(id));
+    zlist_append(self->ready, *reply_p);
+    *reply_p = NULL;
+  }
+  free(service);
+}
+
+// Hedges the requests that are due, sends again or gives up on those whose
+// deadline has passed, and finds the next time we have to do this
+static void
+s_mdp_client_timers(mdp_client_t *self, int64_t now)
+{
+  self->timer_at = 0;
+  for (size_t index = 0; index < self->window; index++) {
+    pending_t *slot = &self->pending[index];
+    if (slot->id == 0) {
+      continue;
+    }
+    if (slot->hedge_at && slot->hedge_at <= now) {
+      slot->hedge_at = 0;
+      if (s_mdp_client_spend(self)) {
+        if (self->verbose) {
+          zclock_log("I: hedging request %u", slot->id);
+        }
+        s_mdp_client_resend(self, slot);
+      }
+    }
+    if (slot->deadline && slot->deadline <= now) {
+      if (slot->retries > 0 && s_mdp_client_spend(self)) {
+        if (self->verbose) {
+          zclock_log("W: no reply, retrying request %u...", slot->id);
+        }
+        slot->retries--;
+        slot->deadline = now + self->timeout;
+        s_mdp_client_resend(self, slot);
+      }
+      else {
+        zmsg_t *reply = zmsg_new();
+        zmsg_pushstr(reply, "504");
+        s_mdp_client_complete(self, slot, MDPC_NAK, &reply);
+        continue;
+      }
+    }
+    s_mdp_client_timer(self, slot->hedge_at);
+    s_mdp_client_timer(self, slot->deadline);
+  }
+}
+
+// Waits up to timeout msecs, or for ever if -1, but no longer than the
+// next timer, and completes the requests whose replies came in or whose
+// time ran out. Returns -1 if interrupted.
+static int
+s_mdp_client_process(mdp_client_t *self, int timeout)
+{
+  int64_t now = zclock_mono();
+  if (self->timer_at) {
+    int64_t left = self->timer_at > now? self->timer_at - now: 0;
+    if (timeout < 0 || left < timeout) {
+      timeout = (int) left;
+    }
+  }
+  zmq_pollitem_t items[] = { { zsock_resolve(self->client), 0, ZMQ_POLLIN, 0 } };
+  if (zmq_poll(items, 1, timeout * ZMQ_POLL_MSEC) == -1) {
+    return -1;            //  Interrupted
+  }
+  while (zsock_events(self->client) & ZMQ_POLLIN) {
+    zmsg_t *reply = zmsg_recv(self->client);
+    if (reply == NULL) {
+      return -1;          //  Interrupted
+    }
+    char *command;
+    uint32_t id = s_mdp_client_unwrap(self, reply, &command, NULL);
+    pending_t *slot = &self->pending[id % self->window];
+    if (id && slot->id == id) {
+      s_mdp_client_complete(self, slot, command, &reply);
+    }
+    else if (self->verbose) {
+      zclock_log("I: dropping reply to an expired or answered request");
+    }
+    free(command);
+    zmsg_destroy(&reply);
+  }
+  if (self->timer_at && zclock_mono() >= self->timer_at) {
+    s_mdp_client_timers(self, zclock_mono());
+  }
+  return 0;
+}
+
+// Returns the next reply in the ready list, for the given request id or
+// for any if 0, waiting up to timeout msecs, or for ever if -1. Any reply
+// but the one to the request of mdp_client_send, which is left for
+// mdp_client_recv, so the two APIs can be mixed.
+static zmsg_t *
+s_mdp_client_next(mdp_client_t *self, uint32_t want, uint32_t *id_p,
+  char **command_p, char **service_p, int timeout)
+{
+  int64_t until = timeout > 0? zclock_mono() + timeout: 0;
+  int expired = 0;
+
+  while (true) {
+    zmsg_t *reply = (zmsg_t *)zlist_first(self->ready);
+    while (reply) {
+      uint32_t id;
+      memcpy(&id, zframe_data(zmsg_first(reply)), sizeof(id));
+      if (want? id == want: id != self->sync_id) {
+        break;
+      }
+      reply = (zmsg_t *)zlist_next(self->ready);
+    }
+    if (reply) {
+      zlist_remove(self->ready, reply);
+      zframe_t *id = zmsg_pop(reply);
+      if (id_p) {
+        memcpy(id_p, zframe_data(id), sizeof(*id_p));
+      }
+      zframe_destroy(&id);
+      char *command = zmsg_popstr(reply);
+      char *service = zmsg_popstr(reply);
+      if (command_p) {
+        *command_p = command;
+      }
+      else {
+        free(command);
+      }
+      if (service_p) {
+        *service_p = service;
+      }
+      else {
+        free(service);
+      }
+      return reply;
+    }
+    //  We do not wait on the request of mdp_client_send for any reply
+    size_t inflight = self->inflight;
+    if (!want && self->sync_id
+    &&  self->pending[self->sync_id % self->window].id == self->sync_id) {
+      inflight--;
+    }
+    if (inflight == 0 || expired) {
+      return NULL;
+    }
+    int wait = timeout;
+    if (timeout > 0) {
+      int64_t left = until - zclock_mono();
+      wait = left > 0? (int) left: 0;
+    }
+    if (s_mdp_client_process(self, wait) == -1) {
+      return NULL;        //  Interrupted
+    }
+    expired = timeout >= 0 && zclock_mono() >= until;
+  }
+}
+
+// Forgets a request: frees its slot, or drops its reply if it came in
+static void
+s_mdp_client_cancel(mdp_client_t *self, uint32_t id)
+{
+  pending_t *slot = &self->pending[id % self->window];
+  if (slot->id == id) {
+    slot->id = 0;
+    free(slot->service);
+    slot->service = NULL;
+    zmsg_destroy(&slot->request);
+    self->inflight--;
+  }
+  else {
+    zmsg_t *reply = s_mdp_client_next(self, id, NULL, NULL, NULL, 0);
+    zmsg_destroy(&reply);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Send a request, taking ownership of it. The reply goes to the callback
+// if there is one, else mdp_client_poll returns it. If the window is full,
+// first waits for a request to complete. Returns the request id, or 0 if
+// interrupted.
+
+uint32_t
+mdp_client_request(mdp_client_t *self, char *service, zmsg_t **request_p,
+  mdp_client_fn *callback, void *args)
+{
+  assert(self);
+  assert(request_p && *request_p);
+
+  if (self->pending == NULL) {
+    self->pending = (pending_t *)zmalloc(self->window * sizeof(pending_t));
+  }
+  while (self->inflight == self->window) {
+    if (s_mdp_client_process(self, -1) == -1) {
+      zmsg_destroy(request_p);
+      return 0;
+    }
+  }
+  //  There is a free slot, so we find one within a window of ids
+  uint32_t id;
+  pending_t *slot;
+  do {
+    id = self->next_id++;
+    slot = &self->pending[id % self->window];
+  } while (id == 0 || slot->id != 0);
+
+  int64_t now = zclock_mono();
+  slot->id = id;
+  slot->sent_at = now;
+  slot->deadline = self->timeout > 0? now + self->timeout: 0;
+  slot->hedge_at = self->hedge && self->hedge_delay?
+    now + self->hedge_delay: 0;
+  slot->retries = self->retries;
+  slot->service = strdup(service);
+  slot->request = self->retries || slot->hedge_at? zmsg_dup(*request_p): NULL;
+  slot->callback = callback;
+  slot->args = args;
+  self->inflight++;
+  s_mdp_client_timer(self, slot->deadline);
+  s_mdp_client_timer(self, slot->hedge_at);
+
+  self->tokens += self->token_rate;
+  if (self->tokens > self->token_max) {
+    self->tokens = self->token_max;
+  }
+  s_mdp_client_send(self, service, request_p, id, 1);
+  return id;
+}
+
+// ---------------------------------------------------------------------
+// Wait up to timeout msecs, or for ever if -1, for the next reply to a
+// request sent without a callback, running the callbacks of others as
+// their replies come in. Returns the reply, with its request id and
+// command filled in if asked for; the caller frees both. Returns NULL if
+// the time runs out, no requests are in flight, or we were interrupted.
+// The reply to the request of mdp_client_send is left for mdp_client_recv.
+
+zmsg_t *
+mdp_client_poll(mdp_client_t *self, uint32_t *id_p, char **command_p,
+  int timeout)
+{
+  assert(self);
+  return s_mdp_client_next(self, 0, id_p, command_p, NULL, timeout);
+}
+
+// ---------------------------------------------------------------------
+// Return how many requests are still in flight
+
+size_t
+mdp_client_pending(mdp_client_t *self)
+{
+  assert(self);
+  return self->inflight;
+}
+
+// Here is the send method. It sends a request to the broker.
+// It takes ownership of the request message, and destroys it when sent.
+// It forgets any earlier request sent this way that was not received.
+void
+mdp_client_send (mdp_client_t *self, char *service, zmsg_t **request_p)
+{
+  assert(self);
+  if (self->sync_id) {
+    s_mdp_client_cancel(self, self->sync_id);
+  }
+  self->sync_id = mdp_client_request(self, service, request_p, NULL, NULL);
+}
+
+// Receive report from the broker, for the request of the last send.
+// The caller is responsible for destroying the received message.
+// If service is not NULL, it is filled in with a pointer
+// to service string. It is caller's responsibility to free it.
+// Returns NULL if it timed out, after any retries, or was interrupted.
+
+zmsg_t *
+mdp_client_recv(mdp_client_t *self, char **command_p, char **service_p)
+{
+  assert(self);
+  if (self->sync_id == 0) {
+    return NULL;
+  }
+  char *command, *service;
+  zmsg_t *msg = s_mdp_client_next(self, self->sync_id, NULL,
+    &command, &service, -1);
+  if (msg == NULL) {
+    return NULL;   //  Interrupt
+  }
+  self->sync_id = 0;
+  if (streq(command, MDPC_NAK) && zframe_streq(zmsg_first(msg), "504")) {
+    zmsg_destroy(&msg);   //  Timed out
+  }
+  if (msg && command_p) {
+    *command_p = command;
+  }
+  else {
+    free(command);
+  }
+  if (msg && service_p) {
+    *service_p = service;
+  }
+  else {
+    free(service);
+  }
   return msg;     //  Success
 }
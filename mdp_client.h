@@ -33,6 +33,11 @@ extern "C" {
 //  Opaque class structure
 typedef struct _mdp_client_t mdp_client_t;
 
+//  Gets the reply to a request sent with mdp_client_request, with its id and command,
+//  REPORT or NAK; it may take the reply, else it is destroyed after
+typedef void (mdp_client_fn)(mdp_client_t *self, uint32_t id, char *command,
+  zmsg_t **reply_p, void *args);
+
 //  @interface
 CZMQ_EXPORT mdp_client_t *
   mdp_client_new(char *broker, int verbose);
@@ -40,6 +45,18 @@ CZMQ_EXPORT void
   mdp_client_destroy(mdp_client_t **self_p);
 CZMQ_EXPORT void
   mdp_client_set_timeout(mdp_client_t *self, int timeout);
+CZMQ_EXPORT void
+  mdp_client_set_priority(mdp_client_t *self, int priority);
+CZMQ_EXPORT void
+  mdp_client_set_key_frame(mdp_client_t *self, int key_frame);
+CZMQ_EXPORT void
+  mdp_client_set_window(mdp_client_t *self, size_t window);
+CZMQ_EXPORT void
+  mdp_client_set_retries(mdp_client_t *self, int retries);
+CZMQ_EXPORT void
+  mdp_client_set_hedge(mdp_client_t *self, int percentile);
+CZMQ_EXPORT void
+  mdp_client_set_retry_budget(mdp_client_t *self, int percent, int burst);
 CZMQ_EXPORT int
   mdp_client_setsockopt(mdp_client_t *self, int option, const void *optval, size_t optvallen);
 CZMQ_EXPORT int
@@ -48,6 +65,14 @@ CZMQ_EXPORT void
   mdp_client_send(mdp_client_t *self, char *service, zmsg_t **request_p);
 CZMQ_EXPORT zmsg_t *
   mdp_client_recv(mdp_client_t *self, char **command_p, char **service_p);
+CZMQ_EXPORT uint32_t
+  mdp_client_request(mdp_client_t *self, char *service, zmsg_t **request_p,
+    mdp_client_fn *callback, void *args);
+CZMQ_EXPORT zmsg_t *
+  mdp_client_poll(mdp_client_t *self, uint32_t *id_p, char **command_p,
+    int timeout);
+CZMQ_EXPORT size_t
+  mdp_client_pending(mdp_client_t *self);
 //  @end
 
 #ifdef __cplusplus
@@ -0,0 +1,128 @@
+/*  =========================================================================
+    mdp_props.c - envelope properties
+
+    -------------------------------------------------------------------------
+    Copyright (c) 1991-2012 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of the Majordomo Project: http://majordomo.zeromq.org,
+    an implementation of rfc.zeromq.org/spec:18/MDP (MDP/0.2) in C.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+    =========================================================================
+*/
+
+#include "mdp_common.h"
+#include "mdp_props.h"
+
+
+// ---------------------------------------------------------------------
+// Start an empty set of props
+void
+mdp_props_init(mdp_props_t *self)
+{
+  assert(self);
+  self->data[0] = 0;
+  self->size = 1;
+}
+
+// ---------------------------------------------------------------------
+// Add a property. Returns 0 if OK, -1 if there is no room for it.
+int
+mdp_props_put(mdp_props_t *self, byte tag, const void *value, size_t size)
+{
+  assert(self);
+  if (self->size + 3 + size > MDP_PROPS_MAX) {
+    return -1;
+  }
+  byte *entry = self->data + self->size;
+  entry[0] = tag;
+  entry[1] = (byte) (size >> 8);
+  entry[2] = (byte) size;
+  memcpy(entry + 3, value, size);
+  self->size += 3 + size;
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Add a property holding a number, as four bytes in network order
+int
+mdp_props_put_number(mdp_props_t *self, byte tag, uint32_t value)
+{
+  byte number[4] = {
+    (byte) (value >> 24), (byte) (value >> 16), (byte) (value >> 8), (byte) value
+  };
+  return mdp_props_put(self, tag, number, 4);
+}
+
+// ---------------------------------------------------------------------
+// Return a new frame holding the props
+zframe_t *
+mdp_props_frame(mdp_props_t *self)
+{
+  assert(self);
+  return zframe_new(self->data, self->size);
+}
+
+// ---------------------------------------------------------------------
+// Check whether a frame is a props frame
+bool
+mdp_props_is(zframe_t *frame)
+{
+  return frame && zframe_size(frame) > 0 && zframe_data(frame)[0] == 0;
+}
+
+// ---------------------------------------------------------------------
+// Find a property in a props frame, without copying it. Returns the
+// value and fills in its size, or returns NULL if the property is not
+// there or the frame is malformed.
+const byte *
+mdp_props_get(zframe_t *frame, byte tag, size_t *size_p)
+{
+  if (!mdp_props_is(frame)) {
+    return NULL;
+  }
+  byte *data = zframe_data(frame);
+  size_t limit = zframe_size(frame);
+  size_t offset = 1;
+
+  while (offset + 3 <= limit) {
+    size_t size = ((size_t) data[offset + 1] << 8) | data[offset + 2];
+    if (offset + 3 + size > limit) {
+      break;
+    }
+    if (data[offset] == tag) {
+      if (size_p) {
+        *size_p = size;
+      }
+      return data + offset + 3;
+    }
+    offset += 3 + size;
+  }
+  return NULL;
+}
+
+// ---------------------------------------------------------------------
+// Return a property holding a number, or missing if it is not there
+int64_t
+mdp_props_get_number(zframe_t *frame, byte tag, int64_t missing)
+{
+  size_t size;
+  const byte *value = mdp_props_get(frame, tag, &size);
+  if (value == NULL || size != 4) {
+    return missing;
+  }
+  return ((int64_t) value[0] << 24) | ((int64_t) value[1] << 16)
+       | ((int64_t) value[2] << 8) | (int64_t) value[3];
+}
@@ -0,0 +1,78 @@
+/*  =========================================================================
+    mdp_props.h - envelope properties
+
+    -------------------------------------------------------------------------
+    Copyright (c) 1991-2012 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of the Majordomo Project: http://majordomo.zeromq.org,
+    an implementation of rfc.zeromq.org/spec:18/MDP (MDP/0.2) in C.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or (at
+    your option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+    =========================================================================
+*/
+
+#ifndef __MDP_PROPS_H_INCLUDED__
+#define __MDP_PROPS_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  A props frame carries optional properties of a request in the MDP
+//  envelope. It starts with a zero byte, which no service name does, and
+//  holds a list of properties, each a one byte tag, a two byte length in
+//  network order, and a value. Clients may send one before the service
+//  name; the broker always sends one after a REQUEST command, and sends
+//  one before the service name of a reply when it has props to echo.
+//  Workers may send one after the service name of READY.
+#define MDP_PROPS_MAX       256     //  Largest props frame we build
+
+//  Property tags
+#define MDP_PROPS_BUDGET    'D'     //  Msecs left to reply, as a number
+#define MDP_PROPS_PRIORITY  'P'     //  Priority class, as a number, 0 first
+#define MDP_PROPS_KEY       'K'     //  Body frame holding the affinity key, as a number
+#define MDP_PROPS_TAG       'T'     //  Set by a peer broker, echoed in the reply
+#define MDP_PROPS_CAPACITY  'N'     //  Requests a worker takes at once, as a number
+#define MDP_PROPS_WEIGHT    'W'     //  Worker's share of requests, as a number
+#define MDP_PROPS_REQUEST   'I'     //  Client's request id, as a number, echoed in the reply
+
+//  Props are built on the stack and then turned into a frame
+typedef struct {
+  byte data[MDP_PROPS_MAX];
+  size_t size;
+} mdp_props_t;
+
+//  @interface
+CZMQ_EXPORT void
+  mdp_props_init(mdp_props_t *self);
+CZMQ_EXPORT int
+  mdp_props_put(mdp_props_t *self, byte tag, const void *value, size_t size);
+CZMQ_EXPORT int
+  mdp_props_put_number(mdp_props_t *self, byte tag, uint32_t value);
+CZMQ_EXPORT zframe_t *
+  mdp_props_frame(mdp_props_t *self);
+CZMQ_EXPORT bool
+  mdp_props_is(zframe_t *frame);
+CZMQ_EXPORT const byte *
+  mdp_props_get(zframe_t *frame, byte tag, size_t *size_p);
+CZMQ_EXPORT int64_t
+  mdp_props_get_number(zframe_t *frame, byte tag, int64_t missing);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
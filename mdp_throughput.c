@@ -0,0 +1,288 @@
+/*  =========================================================================
+    mdp_throughput.c - Majordomo Protocol broker throughput driver
+
+    -------------------------------------------------------------------------
+    Copyright (c) 1991-2012 iMatix Corporation <www.imatix.com>
+    Copyright other contributors as noted in the AUTHORS file.
+
+    This file is part of the Majordomo Project: http://majordomo.zeromq.org,
+    an implementation of rfc.zeromq.org/spec:18/MDP (MDP/0.2) in C.
+
+    This is free software; you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation; either version 3 of the License, or (at your
+    option) any later version.
+
+    This software is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program. If not, see <http://www.gnu.org/licenses/>.
+    =========================================================================
+*/
+
+#include "mdp.h"
+#include "mdp_common.h"
+
+#define HEARTBEAT_INTERVAL  2500    //  msecs, as the broker expects
+#define WORKER_STARTUP      500     //  msecs for workers to register
+
+// Settings shared by the client and worker threads of one run
+typedef struct {
+  char endpoint[256];         //  Broker frontend
+  size_t services;            //  Services the workers are split over
+  size_t requests;            //  Requests per client
+  size_t window;              //  Requests in flight per client
+  size_t body;                //  Bytes per request body
+} bench_t;
+
+typedef struct {
+  bench_t *bench;             //  Settings of the run
+  size_t index;               //  Which client or worker we are
+  size_t reports;             //  REPORTs the client got
+  size_t naks;                //  NAKs, and requests that timed out
+} member_t;
+
+// An echo worker that speaks MDP itself, so that it can stop when the
+// driver tells it to. It takes one request at a time, as the broker's
+// workers do by default, and sends the body straight back.
+static void
+s_echo_worker(zsock_t *pipe, void *args)
+{
+  member_t *self = (member_t *)args;
+  zsock_t *worker = zsock_new_dealer(self->bench->endpoint);
+  char service[32];
+  snprintf(service, sizeof(service), "echo-%zu",
+    self->index % self->bench->services);
+  zsock_send(worker, "zsss", MDPW_WORKER, MDPW_READY, service);
+  zsock_signal(pipe, 0);
+
+  zpoller_t *poller = zpoller_new(pipe, worker, NULL);
+  int64_t heartbeat_at = zclock_mono() + HEARTBEAT_INTERVAL;
+  while (true) {
+    int64_t timeout = heartbeat_at - zclock_mono();
+    zsock_t *which = (zsock_t *)zpoller_wait(poller,
+      timeout > 0? (int) timeout: 0);
+    if (which == pipe || zpoller_terminated(poller)) {
+      break;              //  $TERM, or interrupted
+    }
+    if (which == worker) {
+      //  [""][MDPW0X][REQUEST][props][token][""][body]
+      zmsg_t *msg = zmsg_recv(worker);
+      if (msg && zmsg_size(msg) >= 6) {
+        zframe_t *empty = zmsg_pop(msg);
+        zframe_t *header = zmsg_pop(msg);
+        zframe_t *command = zmsg_pop(msg);
+        if (zframe_streq(command, MDPW_REQUEST)) {
+          zframe_t *props = zmsg_pop(msg);
+          zframe_destroy(&props);
+          zmsg_pushstr(msg, MDPW_REPORT);
+          zmsg_pushstr(msg, MDPW_WORKER);
+          zmsg_pushstr(msg, "");
+          zmsg_send(&msg, worker);
+        }
+        zframe_destroy(&empty);
+        zframe_destroy(&header);
+        zframe_destroy(&command);
+      }
+      zmsg_destroy(&msg);
+    }
+    if (zclock_mono() >= heartbeat_at) {
+      zsock_send(worker, "zss", MDPW_WORKER, MDPW_HEARTBEAT);
+      heartbeat_at = zclock_mono() + HEARTBEAT_INTERVAL;
+    }
+  }
+  zsock_send(worker, "zss", MDPW_WORKER, MDPW_DISCONNECT);
+  zpoller_destroy(&poller);
+  zsock_destroy(&worker);
+}
+
+// Counts the replies a client gets
+static void
+s_client_replied(mdp_client_t *client, uint32_t id, char *command,
+  zmsg_t **reply_p, void *args)
+{
+  member_t *self = (member_t *)args;
+  if (streq(command, MDPC_REPORT)) {
+    self->reports++;
+  }
+  else {
+    self->naks++;
+  }
+}
+
+// A client sends its requests round the services, keeping a window of
+// them in flight, then waits for the last replies and tells the driver
+static void
+s_client(zsock_t *pipe, void *args)
+{
+  member_t *self = (member_t *)args;
+  bench_t *bench = self->bench;
+  mdp_client_t *client = mdp_client_new(bench->endpoint, 0);
+  mdp_client_set_window(client, bench->window);
+  zsock_signal(pipe, 0);
+
+  //  Wait for the driver to start us
+  char *start = zstr_recv(pipe);
+  if (start && streq(start, "START")) {
+    byte *body = (byte *)zmalloc(bench->body);
+    char service[32];
+    for (size_t count = 0; count < bench->requests; count++) {
+      snprintf(service, sizeof(service), "echo-%zu",
+        (self->index + count) % bench->services);
+      zmsg_t *request = zmsg_new();
+      zmsg_addmem(request, body, bench->body);
+      if (mdp_client_request(client, service, &request,
+          s_client_replied, self) == 0) {
+        break;            //  Interrupted
+      }
+    }
+    while (mdp_client_pending(client) && !zctx_interrupted) {
+      zmsg_t *reply = mdp_client_poll(client, NULL, NULL, -1);
+      zmsg_destroy(&reply);
+    }
+    free(body);
+  }
+  free(start);
+  zsock_signal(pipe, 0);
+  mdp_client_destroy(&client);
+
+  //  Stay until the driver is done with us
+  char *command = zstr_recv(pipe);
+  free(command);
+}
+
+// Runs one broker with the given number of shards, and reports how many
+// requests per second the clients got through it
+static void
+s_run(bench_t *bench, size_t shards, size_t nbr_clients, size_t nbr_workers)
+{
+  mdp_broker_t *broker = mdp_broker_new(0);
+  mdp_broker_set_shards(broker, shards);
+  mdp_broker_bind(broker, bench->endpoint);
+  if (mdp_broker_start(broker) == -1) {
+    printf("E: cannot start broker at %s\n", bench->endpoint);
+    mdp_broker_destroy(&broker);
+    return;
+  }
+
+  member_t *workers = (member_t *)zmalloc(nbr_workers * sizeof(member_t));
+  zactor_t **worker_actors = (zactor_t **)zmalloc(nbr_workers * sizeof(zactor_t *));
+  for (size_t index = 0; index < nbr_workers; index++) {
+    workers[index].bench = bench;
+    workers[index].index = index;
+    worker_actors[index] = zactor_new(s_echo_worker, &workers[index]);
+  }
+  member_t *clients = (member_t *)zmalloc(nbr_clients * sizeof(member_t));
+  zactor_t **client_actors = (zactor_t **)zmalloc(nbr_clients * sizeof(zactor_t *));
+  for (size_t index = 0; index < nbr_clients; index++) {
+    clients[index].bench = bench;
+    clients[index].index = index;
+    client_actors[index] = zactor_new(s_client, &clients[index]);
+  }
+  zclock_sleep(WORKER_STARTUP);
+
+  int64_t start = zclock_mono();
+  for (size_t index = 0; index < nbr_clients; index++) {
+    zstr_send(client_actors[index], "START");
+  }
+  size_t reports = 0;
+  size_t naks = 0;
+  for (size_t index = 0; index < nbr_clients; index++) {
+    zsock_wait(client_actors[index]);
+    reports += clients[index].reports;
+    naks += clients[index].naks;
+  }
+  int64_t elapsed = zclock_mono() - start;
+
+  printf("%2zu shards: %zu requests in %" PRId64 " msecs, %.0f/sec, %zu failed\n",
+    shards, reports + naks, elapsed,
+    reports * 1000.0 / (elapsed > 0? elapsed: 1), naks);
+
+  for (size_t index = 0; index < nbr_clients; index++) {
+    zactor_destroy(&client_actors[index]);
+  }
+  for (size_t index = 0; index < nbr_workers; index++) {
+    zactor_destroy(&worker_actors[index]);
+  }
+  free(client_actors);
+  free(clients);
+  free(worker_actors);
+  free(workers);
+  mdp_broker_destroy(&broker);
+}
+
+// Here is the driver. It runs a broker in process with 1 shard, then 2,
+// and so on up to -s, each time with the same clients and echo workers,
+// and prints the throughput of each run.
+int main(int argc, char *argv[])
+{
+  size_t max_shards = 4;
+  size_t nbr_clients = 8;
+  size_t nbr_workers = 16;
+  char *endpoint = "tcp://127.0.0.1:5599";
+  bench_t bench;
+  bench.services = 0;
+  bench.requests = 100000;
+  bench.window = 64;
+  bench.body = 64;
+
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "-s") && i + 1 < argc) {
+      max_shards = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-c") && i + 1 < argc) {
+      nbr_clients = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-w") && i + 1 < argc) {
+      nbr_workers = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-S") && i + 1 < argc) {
+      bench.services = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-n") && i + 1 < argc) {
+      bench.requests = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-W") && i + 1 < argc) {
+      bench.window = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-b") && i + 1 < argc) {
+      bench.body = (size_t) atol(argv[++i]);
+    }
+    else if (streq(argv[i], "-e") && i + 1 < argc) {
+      endpoint = argv[++i];
+    }
+    else {
+      printf("%s [-h] | [-s shards] [-c clients] [-w workers] [-S services] [-n requests] [-W window] [-b bytes] [-e broker url]\n"
+        "\t-h This help message\n"
+        "\t-s Run with 1 up to this many broker threads, defaults to 4\n"
+        "\t-c Client threads, defaults to 8\n"
+        "\t-w Echo worker threads, defaults to 16\n"
+        "\t-S Services the workers are split over, defaults to one per worker\n"
+        "\t-n Requests per client, defaults to 100000\n"
+        "\t-W Requests in flight per client, defaults to 64\n"
+        "\t-b Bytes per request, defaults to 64\n"
+        "\t-e Broker url, defaults to tcp://127.0.0.1:5599\n",
+        argv[0]);
+      return -1;
+    }
+  }
+  if (nbr_clients < 1 || nbr_workers < 1 || bench.window < 1) {
+    printf("E: need at least one client, worker and request in flight\n");
+    return -1;
+  }
+  if (bench.services < 1 || bench.services > nbr_workers) {
+    bench.services = nbr_workers;
+  }
+  snprintf(bench.endpoint, sizeof(bench.endpoint), "%s", endpoint);
+  printf("%zu clients, %zu workers on %zu services, %zu requests of %zu bytes each, window %zu\n",
+    nbr_clients, nbr_workers, bench.services, bench.requests, bench.body,
+    bench.window);
+
+  for (size_t shards = 1; shards <= max_shards && !zctx_interrupted; shards++) {
+    s_run(&bench, shards, nbr_clients, nbr_workers);
+  }
+  return 0;
+}
@@ -25,10 +25,12 @@
 
 #include "mdp_common.h"
 #include "mdp_worker.h"
+#include "mdp_props.h"
 
 
 //  Reliability parameters
 #define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
+#define RECONNECT_MAX       10000   //  Cap on the reconnect backoff, msecs
 
 //  This is the structure of a worker API instance. We use a pseudo-OO
 //  approach in a lot of the C examples, as well as the CZMQ binding:
@@ -40,13 +42,24 @@ struct _mdp_worker_t {
   char *broker;               //  "path_to_connect"
   char *service;
   zsock_t *worker;            //  Socket to broker
+  zactor_t *monitor;          //  Tells us when the socket connects
+  int connects;               //  Connections the monitor has seen
+  int registered;             //  We have sent READY, on first recv or run
   int verbose;                //  Print activity to stdout
 
-  //  Heartbeat management
-  uint64_t heartbeat_at;      //  When to send HEARTBEAT
-  size_t liveness;            //  How many attempts left
+  //  Heartbeat management; any message counts as a heartbeat, both ways
+  int64_t heartbeat_at;       //  When to send HEARTBEAT, if we are quiet
+  int64_t expiry;             //  When we give up on a silent broker
+  int64_t reconnect_at;       //  When to reconnect, or 0 if connected
+  int attempts;               //  Reconnects since we last heard the broker
   int heartbeat;              //  Heartbeat delay, msecs
-  int reconnect;              //  Reconnect delay, msecs
+  int reconnect;              //  Initial reconnect delay, msecs
+
+  int64_t deadline;           //  When the client gives up on the current
+                              //  request, or 0 if it has no deadline
+  int capacity;               //  Requests we take at once, or 0 to let
+                              //  the broker decide
+  int weight;                 //  Our share of requests, or 0 for capacity
 };
 
 // We have two utility functions; to send a message to the broker and
@@ -77,12 +90,44 @@ s_mdp_worker_send_to_broker(mdp_worker_t *self, char *command, char *option, zms
     zmsg_dump(msg);
   }
   zmsg_send(&msg, zsock_resolve(self->worker));
+  self->heartbeat_at = zclock_mono() + self->heartbeat;
+}
+
+// ---------------------------------------------------------------------
+// Register service with broker, with our capacity and weight if set
+static void
+s_mdp_worker_register(mdp_worker_t *self)
+{
+  zmsg_t *msg = NULL;
+  if (self->capacity > 0 || self->weight > 0) {
+    mdp_props_t props;
+    mdp_props_init(&props);
+    if (self->capacity > 0) {
+      mdp_props_put_number(&props, MDP_PROPS_CAPACITY, (uint32_t) self->capacity);
+    }
+    if (self->weight > 0) {
+      mdp_props_put_number(&props, MDP_PROPS_WEIGHT, (uint32_t) self->weight);
+    }
+    zframe_t *frame = mdp_props_frame(&props);
+    msg = zmsg_new();
+    zmsg_append(msg, &frame);
+  }
+  s_mdp_worker_send_to_broker(self, MDPW_READY, self->service, msg);
+  zmsg_destroy(&msg);
+  self->registered = 1;
+
+  // If we hear nothing by expiry, worker is considered disconnected
+  self->expiry = zclock_mono() + self->heartbeat * HEARTBEAT_LIVENESS;
+  self->reconnect_at = 0;
 }
 
 // ---------------------------------------------------------------------
-// Connect or reconnect to broker
+// Connect or reconnect to broker. We register on the first recv or run,
+// so that settings made before then go with READY, and again on every
+// reconnect after that.
 void s_mdp_worker_connect_to_broker(mdp_worker_t *self)
 {
+  zactor_destroy(&self->monitor);
   if (self->worker) {
     zsock_destroy(&self->worker);
   }
@@ -93,17 +138,23 @@ void s_mdp_worker_connect_to_broker(mdp_worker_t *self)
   // sufficient for common cases without significant delay in broken ones.
   zsock_set_linger(self->worker, 100);
 
+  // The socket reconnects by itself when the broker comes back, but
+  // the broker will not know us; the monitor tells us, so we can
+  // register again at once
+  self->monitor = zactor_new(zmonitor, self->worker);
+  zstr_sendx(self->monitor, "LISTEN", "CONNECTED", NULL);
+  zstr_sendx(self->monitor, "START", NULL);
+  zsock_wait(self->monitor);
+  self->connects = 0;
+
   zsock_connect(self->worker, "%s", self->broker);
   if (self->verbose) {
     zclock_log("I: connecting to broker at %s...", self->broker);
   }
 
-  // Register service with broker
-  s_mdp_worker_send_to_broker(self, MDPW_READY, self->service, NULL);
-
-  // If liveness hits zero, worker is considered disconnected
-  self->liveness = HEARTBEAT_LIVENESS;
-  self->heartbeat_at = zclock_time() + self->heartbeat;
+  if (self->registered) {
+    s_mdp_worker_register(self);
+  }
 }
 
 // Here we have the constructor and destructor for our mdp_worker class
@@ -122,7 +173,7 @@ mdp_worker_new(char *broker,char *service, int verbose)
   self->service = strdup(service);
   self->verbose = verbose;
   self->heartbeat = 2500;     // msecs
-  self->reconnect = 2500;     // msecs
+  self->reconnect = 250;      // msecs
   self->worker = NULL;
 
   s_mdp_worker_connect_to_broker(self);
@@ -139,8 +190,11 @@ mdp_worker_destroy(mdp_worker_t **self_p)
   if (*self_p) {
     mdp_worker_t *self = *self_p;
 
-    s_mdp_worker_send_to_broker(self, MDPW_DISCONNECT, NULL, NULL);
+    if (self->registered) {
+      s_mdp_worker_send_to_broker(self, MDPW_DISCONNECT, NULL, NULL);
+    }
 
+    zactor_destroy(&self->monitor);
     zsock_destroy(&self->worker);
 
     free(self->broker);
@@ -170,7 +224,29 @@ mdp_worker_set_linger(mdp_worker_t *self, int linger)
 }
 
 // ---------------------------------------------------------------------
-// Set reconnect delay
+// Set how many requests the broker may send us at once, and our share of
+// requests relative to other workers for the service, which defaults to
+// the capacity. A host with more cores can say so. Pass 0 for either to
+// leave it to the broker. The broker learns these when we register, on
+// the first recv; after that, this starts a new session with the broker,
+// and requests it sent us in the old one are lost, so call it before.
+
+void
+mdp_worker_set_capacity(mdp_worker_t *self, int capacity, int weight)
+{
+  assert(self);
+  self->capacity = capacity;
+  self->weight = weight;
+  if (self->registered) {
+    s_mdp_worker_send_to_broker(self, MDPW_DISCONNECT, NULL, NULL);
+    s_mdp_worker_connect_to_broker(self);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Set the initial reconnect delay. While the broker stays away the delay
+// doubles, up to RECONNECT_MAX, and each worker waits a random part of it
+// so that they do not all come back at once.
 void
 mdp_worker_set_reconnect(mdp_worker_t *self, int reconnect)
 {
@@ -199,6 +275,129 @@ mdp_worker_getsockopt(mdp_worker_t *self,  int option, void *optval, size_t *opt
   return zmq_getsockopt(zsock_resolve(self->worker), option, optval, optvallen);
 }
 
+// These helpers are shared by the recv method and the run method. The
+// accept method takes one message from the broker. It returns the body of
+// a request, with the client's address in *reply_to_p, or NULL if it was a
+// command we handled here.
+static zmsg_t *
+s_mdp_worker_accept(mdp_worker_t *self, zmsg_t *msg, zframe_t **reply_to_p)
+{
+  if (self->verbose) {
+    zclock_log("I: received message from broker:");
+    zmsg_dump(msg);
+  }
+  self->expiry = zclock_mono() + self->heartbeat * HEARTBEAT_LIVENESS;
+  self->reconnect_at = 0;
+  self->attempts = 0;
+
+  // Don't try to handle errors, just assert noisily
+  assert(zmsg_size(msg) >= 3);
+
+  zframe_t *empty = zmsg_pop(msg);
+  assert(zframe_streq(empty, ""));
+  zframe_destroy(&empty);
+
+  zframe_t *header = zmsg_pop(msg);
+  assert(zframe_streq(header, MDPW_WORKER));
+  zframe_destroy(&header);
+
+  zframe_t *command = zmsg_pop(msg);
+  if (zframe_streq(command, MDPW_REQUEST)) {
+    // The broker tells us how long the client will wait for a reply
+    zframe_t *props = zmsg_pop(msg);
+    int64_t budget = mdp_props_get_number(props, MDP_PROPS_BUDGET, -1);
+    self->deadline = budget >= 0? zclock_mono() + budget: 0;
+    zframe_destroy(&props);
+
+    // We should pop and save as many addresses as there are
+    // up to a null part, but for now, just save one...
+    zframe_t *reply_to = zmsg_unwrap(msg);
+    if (reply_to_p) {
+      *reply_to_p = reply_to;
+    }
+    else {
+      zframe_destroy(&reply_to);
+    }
+
+    zframe_destroy(&command);
+    // Here is where we actually have a message to process; we
+    // return it to the caller application
+    return msg;     // We have a request to process
+  }
+  else if (zframe_streq(command, MDPW_HEARTBEAT)) {
+    //0;              //  Do nothing for heartbeats
+  }
+  else if (zframe_streq(command, MDPW_DISCONNECT)) {
+    s_mdp_worker_connect_to_broker(self);
+  }
+  else {
+    zclock_log("E: invalid input message");
+    zmsg_dump(msg);
+  }
+  zframe_destroy(&command);
+  zmsg_destroy(&msg);
+  return NULL;
+}
+
+// The poll items method fills in the items for the broker socket and
+// its monitor, which are new after each reconnect, and returns how long
+// to poll for: until the next thing the heartbeat method has to do.
+static int
+s_mdp_worker_poll_items(mdp_worker_t *self, zmq_pollitem_t *items)
+{
+  items[0] = (zmq_pollitem_t) { zsock_resolve(self->worker), 0, ZMQ_POLLIN, 0 };
+  items[1] = (zmq_pollitem_t) { zsock_resolve(self->monitor), 0, ZMQ_POLLIN, 0 };
+
+  int64_t next = self->reconnect_at;
+  if (next == 0) {
+    next = self->expiry < self->heartbeat_at? self->expiry: self->heartbeat_at;
+  }
+  int64_t timeout = next - zclock_mono();
+  return timeout > 0? (int) timeout: 0;
+}
+
+// The heartbeat method is called after each poll. If the socket has
+// connected again we register again. If we heard nothing from the broker
+// for too long we reconnect, after a jittered backoff that the poll waits
+// out for us, and if we sent nothing for a heartbeat we send a HEARTBEAT.
+static void
+s_mdp_worker_heartbeat(mdp_worker_t *self, zmq_pollitem_t *items)
+{
+  if (items[1].revents & ZMQ_POLLIN) {
+    zmsg_t *event = zmsg_recv(self->monitor);
+    zmsg_destroy(&event);
+    //  We registered on the first connection when we sent READY
+    if (self->connects++ > 0) {
+      if (self->verbose) {
+        zclock_log("I: reconnected to broker - registering...");
+      }
+      s_mdp_worker_register(self);
+    }
+  }
+  int64_t now = zclock_mono();
+  if (self->reconnect_at) {
+    if (now >= self->reconnect_at) {
+      s_mdp_worker_connect_to_broker(self);
+    }
+  }
+  else if (now >= self->expiry) {
+    int64_t backoff = (int64_t) self->reconnect << (self->attempts < 16? self->attempts: 16);
+    if (backoff > RECONNECT_MAX) {
+      backoff = RECONNECT_MAX;
+    }
+    self->reconnect_at = now + backoff / 2 + randof(backoff / 2 + 1);
+    self->attempts++;
+    if (self->verbose) {
+      zclock_log("W: disconnected from broker - retrying in %d msecs...",
+        (int) (self->reconnect_at - now));
+    }
+  }
+  // Send HEARTBEAT if we have been quiet for a heartbeat
+  if (!self->reconnect_at && now >= self->heartbeat_at) {
+    s_mdp_worker_send_to_broker(self, MDPW_HEARTBEAT, NULL, NULL);
+  }
+}
+
 // This is the recv method; it receives a new request from a client.
 // If reply_to_p is not NULL, a pointer to client's address is filled in.
 
@@ -207,9 +406,13 @@ mdp_worker_getsockopt(mdp_worker_t *self,  int option, void *optval, size_t *opt
 zmsg_t *
 mdp_worker_recv(mdp_worker_t *self, zframe_t **reply_to_p)
 {
+  if (!self->registered) {
+    s_mdp_worker_register(self);
+  }
   while (true) {
-    zmq_pollitem_t items[] = { {zsock_resolve(self->worker),  0, ZMQ_POLLIN, 0} };
-    int rc = zmq_poll(items, 1, self->heartbeat * ZMQ_POLL_MSEC);
+    zmq_pollitem_t items[2];
+    int timeout = s_mdp_worker_poll_items(self, items);
+    int rc = zmq_poll(items, 2, timeout * ZMQ_POLL_MSEC);
     if (rc == -1) {
       break;              //  Interrupted
     }
@@ -219,73 +422,197 @@ mdp_worker_recv(mdp_worker_t *self, zframe_t **reply_to_p)
       if (!msg) {
         break;          //  Interrupted
       }
-
-      if (self->verbose) {
-        zclock_log("I: received message from broker:");
-        zmsg_dump(msg);
+      zmsg_t *request = s_mdp_worker_accept(self, msg, reply_to_p);
+      if (request) {
+        return request;
       }
-      self->liveness = HEARTBEAT_LIVENESS;
-
-      // Don't try to handle errors, just assert noisily
-      assert(zmsg_size(msg) >= 3);
-
-      zframe_t *empty = zmsg_pop(msg);
-      assert(zframe_streq(empty, ""));
-      zframe_destroy(&empty);
-
-      zframe_t *header = zmsg_pop(msg);
-      assert(zframe_streq(header, MDPW_WORKER));
-      zframe_destroy(&header);
-
-      zframe_t *command = zmsg_pop(msg);
-      if (zframe_streq(command, MDPW_REQUEST)) {
-        // We should pop and save as many addresses as there are
-        // up to a null part, but for now, just save one...
-        zframe_t *reply_to = zmsg_unwrap(msg);
-        if (reply_to_p) {
-          *reply_to_p = reply_to;
-        }
-        else {
-          zframe_destroy(&reply_to);
-        }
+    }
+    s_mdp_worker_heartbeat(self, items);
+  }
+  if (zctx_interrupted) {
+    printf("W: interrupt received, killing worker...\n");
+  }
+
+  return NULL;
+}
+
+// Here is the concurrent side of the worker API. The run method hands
+// requests to a pool of task threads, each of which calls the handler on
+// one request at a time, while this thread keeps up the session with the
+// broker. A task gets [reply_to][deadline][body] on its pipe and sends
+// back [reply_to][report], so reports go out in whatever order they are
+// done. The broker never sends more requests than we have tasks, but we
+// keep a backlog for those that come in while a report is on its way.
+typedef struct {
+  mdp_worker_handler_fn *handler;
+  void *args;
+} mdp_worker_task_t;
+
+static void
+s_mdp_worker_task(zsock_t *pipe, void *args)
+{
+  mdp_worker_task_t *task = (mdp_worker_task_t *)args;
+  zsock_signal(pipe, 0);
+
+  while (true) {
+    zmsg_t *msg = zmsg_recv(pipe);
+    if (!msg || (zmsg_size(msg) == 1 && zframe_streq(zmsg_first(msg), "$TERM"))) {
+      zmsg_destroy(&msg);
+      break;            //  Interrupted, or told to stop
+    }
+    zframe_t *reply_to = zmsg_pop(msg);
+    zframe_t *deadline_frame = zmsg_pop(msg);
+    int64_t deadline = 0;
+    memcpy(&deadline, zframe_data(deadline_frame), sizeof(deadline));
+    zframe_destroy(&deadline_frame);
+
+    int budget = -1;
+    if (deadline) {
+      int64_t left = deadline - zclock_mono();
+      budget = left > 0? (int) left: 0;
+    }
+    zmsg_t *report = task->handler(msg, budget, task->args);
+    zmsg_destroy(&msg);
+    if (report == NULL) {
+      report = zmsg_new();
+    }
+    zmsg_prepend(report, &reply_to);
+    zmsg_send(&report, pipe);
+  }
+}
+
+// Hands a request to a task, with its deadline
+static void
+s_mdp_worker_hand(zactor_t *task, zmsg_t **request_p, zframe_t *reply_to,
+  int64_t deadline)
+{
+  zmsg_pushmem(*request_p, &deadline, sizeof(deadline));
+  zmsg_prepend(*request_p, &reply_to);
+  zmsg_send(request_p, task);
+}
+
+// ---------------------------------------------------------------------
+// Serve requests with a handler, on up to concurrency requests at once,
+// until interrupted. The handler runs in a task thread; it gets the body
+// of a request and the msecs its client will still wait, or -1, and
+// returns the report, or NULL for an empty one. It must not keep the
+// request. The broker is told our capacity when we register, so it sends
+// us no more than we can take. If we already registered, on an earlier
+// recv, the broker keeps the capacity it has, and requests beyond ours
+// wait for a task. Returns 0 when interrupted.
+
+int
+mdp_worker_run(mdp_worker_t *self, mdp_worker_handler_fn *handler,
+  void *args, int concurrency)
+{
+  assert(self);
+  assert(handler);
+  assert(concurrency > 0);
+
+  mdp_worker_task_t task = { handler, args };
+  zactor_t **tasks = (zactor_t **)zmalloc(concurrency * sizeof(zactor_t *));
+  zmq_pollitem_t *items = (zmq_pollitem_t *)zmalloc(
+    (concurrency + 2) * sizeof(zmq_pollitem_t));
+  zlist_t *idle = zlist_new();
+  zlist_t *backlog = zlist_new();
+  for (int index = 0; index < concurrency; index++) {
+    tasks[index] = zactor_new(s_mdp_worker_task, &task);
+    items[index + 2] = (zmq_pollitem_t) {
+      zsock_resolve(tasks[index]), 0, ZMQ_POLLIN, 0
+    };
+    zlist_append(idle, tasks[index]);
+  }
+  //  Not through set_capacity, which would start a new session and lose
+  //  the requests the broker sent us in this one
+  if (!self->registered) {
+    self->capacity = concurrency;
+    s_mdp_worker_register(self);
+  }
+
+  int interrupted = 0;
+  while (!interrupted) {
+    int timeout = s_mdp_worker_poll_items(self, items);
+    int rc = zmq_poll(items, concurrency + 2, timeout * ZMQ_POLL_MSEC);
+    if (rc == -1) {
+      break;              //  Interrupted
+    }
 
-        zframe_destroy(&command);
-        // Here is where we actually have a message to process; we
-        // return it to the caller application
-        return msg;     // We have a request to process
+    //  Send back the reports that are done, and give the tasks that did
+    //  them the next requests
+    for (int index = 0; index < concurrency; index++) {
+      if (!(items[index + 2].revents & ZMQ_POLLIN)) {
+        continue;
       }
-      else if (zframe_streq(command, MDPW_HEARTBEAT)) {
-        //0;              //  Do nothing for heartbeats
+      zmsg_t *report = zmsg_recv(tasks[index]);
+      if (!report) {
+        interrupted = 1;
+        break;
       }
-      else if (zframe_streq(command, MDPW_DISCONNECT)) {
-        s_mdp_worker_connect_to_broker(self);
+      zframe_t *reply_to = zmsg_pop(report);
+      mdp_worker_send(self, &report, reply_to);
+      zframe_destroy(&reply_to);
+
+      zmsg_t *request = (zmsg_t *)zlist_pop(backlog);
+      if (request) {
+        zmsg_send(&request, tasks[index]);
       }
       else {
-        zclock_log("E: invalid input message");
-        zmsg_dump(msg);
+        zlist_append(idle, tasks[index]);
       }
-      zframe_destroy(&command);
-      zmsg_destroy(&msg);
     }
-    else
-    if (--self->liveness == 0) {
-      if (self->verbose) {
-        zclock_log("W: disconnected from broker - retrying...");
+    if (items[0].revents & ZMQ_POLLIN) {
+      zmsg_t *msg = zmsg_recv(zsock_resolve(self->worker));
+      if (!msg) {
+        break;          //  Interrupted
+      }
+      zframe_t *reply_to;
+      zmsg_t *request = s_mdp_worker_accept(self, msg, &reply_to);
+      if (request) {
+        zactor_t *task = (zactor_t *)zlist_pop(idle);
+        if (task) {
+          s_mdp_worker_hand(task, &request, reply_to, self->deadline);
+        }
+        else {
+          zmsg_pushmem(request, &self->deadline, sizeof(self->deadline));
+          zmsg_prepend(request, &reply_to);
+          zlist_append(backlog, request);
+        }
       }
-      zclock_sleep(self->reconnect);
-      s_mdp_worker_connect_to_broker(self);
-    }
-    // Send HEARTBEAT if it's time
-    if (zclock_time() > self->heartbeat_at) {
-      s_mdp_worker_send_to_broker(self, MDPW_HEARTBEAT, NULL, NULL);
-      self->heartbeat_at = zclock_time() + self->heartbeat;
     }
+    s_mdp_worker_heartbeat(self, items);
   }
   if (zctx_interrupted) {
     printf("W: interrupt received, killing worker...\n");
   }
 
-  return NULL;
+  for (int index = 0; index < concurrency; index++) {
+    zactor_destroy(&tasks[index]);
+  }
+  while (zlist_size(backlog)) {
+    zmsg_t *request = (zmsg_t *)zlist_pop(backlog);
+    zmsg_destroy(&request);
+  }
+  zlist_destroy(&backlog);
+  zlist_destroy(&idle);
+  free(items);
+  free(tasks);
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Return how many msecs the client of the current request will still wait
+// for a reply, or -1 if it set no deadline. Work on a request that has
+// run out of time is wasted, as nobody will read the reply.
+
+int
+mdp_worker_budget(mdp_worker_t *self)
+{
+  assert(self);
+  if (self->deadline == 0) {
+    return -1;
+  }
+  int64_t budget = self->deadline - zclock_mono();
+  return budget > 0? (int) budget: 0;
 }
 
 // ---------------------------------------------------------------------
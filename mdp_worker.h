@@ -33,6 +33,11 @@ extern "C" {
 //  Opaque class structure
 typedef struct _mdp_worker_t mdp_worker_t;
 
+//  Handles one request for mdp_worker_run: takes the request body and the
+//  msecs its client will still wait, or -1, and returns the report
+typedef zmsg_t *(mdp_worker_handler_fn)(zmsg_t *request, int budget,
+  void *args);
+
 //  @interface
 CZMQ_EXPORT mdp_worker_t *
   mdp_worker_new(char *broker,char *service, int verbose);
@@ -42,6 +47,8 @@ CZMQ_EXPORT void
   mdp_worker_set_heartbeat(mdp_worker_t *self, int heartbeat);
 CZMQ_EXPORT void
   mdp_worker_set_reconnect(mdp_worker_t *self, int reconnect);
+CZMQ_EXPORT void
+  mdp_worker_set_capacity(mdp_worker_t *self, int capacity, int weight);
 CZMQ_EXPORT int
   mdp_worker_setsockopt(mdp_worker_t *self, int option, const void *optval, size_t optvallen);
 CZMQ_EXPORT int
@@ -50,6 +57,11 @@ CZMQ_EXPORT zmsg_t *
   mdp_worker_recv(mdp_worker_t *self, zframe_t **reply_p);
 CZMQ_EXPORT void
   mdp_worker_send(mdp_worker_t *self, zmsg_t **progress_p, zframe_t *reply_to);
+CZMQ_EXPORT int
+  mdp_worker_budget(mdp_worker_t *self);
+CZMQ_EXPORT int
+  mdp_worker_run(mdp_worker_t *self, mdp_worker_handler_fn *handler,
+    void *args, int concurrency);
 //  @end
 
 #ifdef __cplusplus
@@ -17,15 +17,15 @@ typedef struct _mm_engine_t mm_engine_t;
 
 
 static mm_engine_t *
-s_mm_engine_new(int verbose)
+s_mm_engine_new(char *broker, char *db_broker, int verbose)
 {
   mm_engine_t *self;
   mdp_worker_t *to_client;
   mdp_client_t *to_mongodb;
 
   self = (mm_engine_t *)zmalloc(sizeof *self);
-  to_client = mdp_worker_new("tcp://localhost:5555", "MM", verbose);
-  to_mongodb = mdp_client_new("tcp://localhost:8888", verbose);
+  to_client = mdp_worker_new(broker, "MM", verbose);
+  to_mongodb = mdp_client_new(db_broker, verbose);
 
   self->to_client = to_client;
   self->to_mongodb = to_mongodb;
@@ -230,14 +230,47 @@ s_mm_handle_request(mm_engine_t *self, zmsg_t *request, zframe_t *reply_to)
  * This worker simulates the the Purchase Order (PO) processing engine in an
  * ERP Material Management (MM) service and return the results back to the
  * client
+ *
+ * mm_worker [-v] [-e db broker url] [broker url] [db broker url]
+ * A worker on the same host as its brokers can reach them over ipc://
+ *
+ * With -e, the worker hosts the DB broker itself, bound to the given url
+ * for the mongodb_workers, and sends its own requests to it over inproc://
+ * instead of through a separate broker process
  */
 int main(int argc, char *argv[])
 {
-  int verbose;
+  int verbose = 0;
+  char *brokers[2] = { "tcp://localhost:5555", "tcp://localhost:8888" };
+  int nbr_brokers = 0;
+  char *db_endpoint = NULL;
+  mdp_broker_t *db_broker = NULL;
   mm_engine_t *engine;
 
-  verbose = (argc > 1 && streq(argv[1], "-v"));
-  engine = s_mm_engine_new(verbose);
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "-v")) {
+      verbose = 1;
+    }
+    else if (streq(argv[i], "-e") && i + 1 < argc) {
+      db_endpoint = argv[++i];
+    }
+    else if (nbr_brokers < 2) {
+      brokers[nbr_brokers++] = argv[i];
+    }
+  }
+
+  if (db_endpoint) {
+    db_broker = mdp_broker_new(verbose);
+    mdp_broker_bind(db_broker, db_endpoint);
+    mdp_broker_bind(db_broker, "inproc://db-broker");
+    if (mdp_broker_start(db_broker) == -1) {
+      printf("E: cannot start the DB broker at %s\n", db_endpoint);
+      mdp_broker_destroy(&db_broker);
+      return -1;
+    }
+    brokers[1] = "inproc://db-broker";
+  }
+  engine = s_mm_engine_new(brokers[0], brokers[1], verbose);
 
   while (true) {
     zframe_t *reply_to;
@@ -250,6 +283,7 @@ int main(int argc, char *argv[])
   }
 
   s_mm_engine_destroy(&engine);
+  mdp_broker_destroy(&db_broker);
 
   return 0;
 }
@@ -9,28 +9,27 @@
 
 struct _mongodb_engine_t {
   mdp_worker_t *session;
-  mongoc_client_t *mongo_client;
+  mongoc_uri_t *mongo_uri;
+  mongoc_client_pool_t *mongo_pool;   /* one client per request in flight */
 };
 
 typedef struct _mongodb_engine_t mongodb_engine_t;
 
 
 static mongodb_engine_t *
-s_mongodb_engine_new(int verbose)
+s_mongodb_engine_new(char *broker, int verbose)
 {
   mongodb_engine_t *self;
   mdp_worker_t *session;
-  mongoc_client_t *client;
 
   self = (mongodb_engine_t *)zmalloc(sizeof *self);
-  session = mdp_worker_new("tcp://localhost:8888", "MongoDB", verbose);
+  session = mdp_worker_new(broker, "MongoDB", verbose);
 
   mongoc_init();
   /* Connects to a mongodb database or a mongodb replica set's PRIMARY node */
-  client = mongoc_client_new("mongodb://localhost:30001/?appname=mongodb_engine");
-
+  self->mongo_uri = mongoc_uri_new("mongodb://localhost:30001/?appname=mongodb_engine");
+  self->mongo_pool = mongoc_client_pool_new(self->mongo_uri);
   self->session = session;
-  self->mongo_client = client;
 
   return self;
 }
@@ -43,7 +42,8 @@ s_mongodb_engine_destroy(mongodb_engine_t **self_p)
   if (*self_p) {
     mongodb_engine_t *self = *self_p;
     mdp_worker_destroy(&self->session);
-    mongoc_client_destroy(self->mongo_client);
+    mongoc_client_pool_destroy(self->mongo_pool);
+    mongoc_uri_destroy(self->mongo_uri);
     mongoc_cleanup();
     free(self);
     *self_p = NULL;
@@ -195,13 +195,19 @@ s_mongodb_handle_delete(zmsg_t *report, zmsg_t *request, mongoc_collection_t *co
 }
 
 
-static void
-s_mongodb_handle_request(mongodb_engine_t *self, zmsg_t *request, zframe_t *reply_to)
+/*
+ * Runs in one of the worker's tasks, so it takes a client of its own from
+ * the pool for the request
+ */
+static zmsg_t *
+s_mongodb_handle_request(zmsg_t *request, int budget, void *args)
 {
+  mongodb_engine_t *self = (mongodb_engine_t *)args;
   char *db;
   char *collection;
   char *operation;
   zmsg_t *report;
+  mongoc_client_t *client;
   mongoc_collection_t *coll;
 
   /* db is obtained from mm_worker's request */
@@ -212,7 +218,8 @@ s_mongodb_handle_request(mongodb_engine_t *self, zmsg_t *request, zframe_t *repl
   report = zmsg_new();
 
   /* get the collection from the db */
-  coll = mongoc_client_get_collection(self->mongo_client, db, collection);
+  client = mongoc_client_pool_pop(self->mongo_pool);
+  coll = mongoc_client_get_collection(client, db, collection);
 
   /* CRUD operations */
   if (strcmp(operation, "CREATE") == 0) {
@@ -231,40 +238,54 @@ s_mongodb_handle_request(mongodb_engine_t *self, zmsg_t *request, zframe_t *repl
     s_mongodb_handle_delete(report, request, coll);
   }
 
-  /* Send the report back */
-  mdp_worker_send(self->session, &report, reply_to);
-  zframe_destroy(&reply_to);
-
   /* clean up */
   free(operation);
   free(collection);
   free(db);
   mongoc_collection_destroy(coll);
-  zmsg_destroy(&request);
-  zmsg_destroy(&report);
+  mongoc_client_pool_push(self->mongo_pool, client);
+
+  /* the worker sends the report back */
+  return report;
 }
 
 /*
  * This worker provides the simple CRUD services of Mongodb and sends
  * results back to the respective clients
+ *
+ * mongodb_worker [-v] [-n concurrency] [broker url]
+ * A worker on the same host as its broker can reach it over ipc://
+ *
+ * With -n, the worker keeps up to that many MongoDB operations in flight,
+ * each with a client of its own, and the broker sends it that many requests
+ * at once
  */
 int main(int argc, char *argv[])
 {
-  int verbose;
+  int verbose = 0;
+  int concurrency = 1;
+  char *broker = "tcp://localhost:8888";
   mongodb_engine_t *mdb_engine;
 
-  verbose = (argc > 1 && streq(argv[1], "-v"));
-  mdb_engine = s_mongodb_engine_new(verbose);
-
-  while (true) {
-    zframe_t *reply_to;
-    zmsg_t *request = mdp_worker_recv(mdb_engine->session, &reply_to);
-    if (request == NULL) {
-      break;              /* Worker was interrupted */
+  for (int i = 1; i < argc; i++) {
+    if (streq(argv[i], "-v")) {
+      verbose = 1;
+    }
+    else if (streq(argv[i], "-n") && i + 1 < argc) {
+      concurrency = atoi(argv[++i]);
+      if (concurrency < 1) {
+        concurrency = 1;
+      }
+    }
+    else {
+      broker = argv[i];
     }
-
-    s_mongodb_handle_request(mdb_engine, request, reply_to);
   }
+  mdb_engine = s_mongodb_engine_new(broker, verbose);
+
+  /* Returns when the worker was interrupted */
+  mdp_worker_run(mdb_engine->session, s_mongodb_handle_request, mdb_engine,
+    concurrency);
 
   s_mongodb_engine_destroy(&mdb_engine);
 
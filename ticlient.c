@@ -60,6 +60,10 @@ int main(int argc, char *argv [])
     zframe_print(uuid, "I: request UUID ");
   }
 
+  /* titanic.reply and titanic.close are safe to repeat, so a lost or
+   * slow reply is retried rather than ending the client */
+  mdp_client_set_retries(session, 3);
+
   /* 2. Wait until we get a reply */
   while (!zctx_interrupted) {
     zclock_sleep(100);
@@ -5,6 +5,7 @@
 
 
 #include "mdp.h"
+#include "mdp_common.h"
 #include "zfile.h"
 #include <uuid/uuid.h>
 
@@ -230,12 +231,71 @@ titanic_close(zsock_t *pipe, void *args)
  * .split try to call a service
  * Here, we first check if the requested MDP service is defined or not,
  * using a MMI lookup to the Majordomo broker. If the service exists,
- * we send a request and wait for a reply using the conventional MDP
- * client API. This is not meant to be fast, just very simple:
+ * we send the request. The calls for all the waiting requests are in
+ * flight at once on one client session, each going on to its next step
+ * from a callback, so a pass over the queue takes a round trip or two
+ * rather than two per request:
  */
-static int
-s_service_success(char *uuid)
+typedef struct {
+  char *uuid;
+  long offset;              /* of the entry's mark in the queue file */
+  char *service_name;
+  zmsg_t *request;
+  int success;
+} titanic_call_t;
+
+static void
+s_service_call_destroy(titanic_call_t **self_p)
+{
+  assert(self_p);
+
+  if (*self_p) {
+    titanic_call_t *self = *self_p;
+    zmsg_destroy(&self->request);
+    free(self->service_name);
+    free(self->uuid);
+    free(self);
+    *self_p = NULL;
+  }
+}
+
+static void
+s_service_replied(mdp_client_t *client, uint32_t id, char *command,
+  zmsg_t **reply_p, void *args)
+{
+  titanic_call_t *call = (titanic_call_t *)args;
+
+  /* A NAK, as from a busy broker, leaves the request for the next pass */
+  if (streq(command, MDPC_REPORT)) {
+    char *filename = s_reply_filename(call->uuid);
+    FILE *file = fopen(filename, "w");
+    assert(file);
+    zmsg_save(*reply_p, file);
+    fclose(file);
+    free(filename);
+    call->success = 1;
+  }
+}
+
+static void
+s_service_checked(mdp_client_t *client, uint32_t id, char *command,
+  zmsg_t **reply_p, void *args)
+{
+  titanic_call_t *call = (titanic_call_t *)args;
+
+  if (streq(command, MDPC_REPORT) && zframe_streq(zmsg_first(*reply_p), "200")) {
+    mdp_client_request(client, call->service_name, &call->request,
+      s_service_replied, call);
+  }
+}
+
+static titanic_call_t *
+s_service_call(mdp_client_t *client, char *uuid, long offset)
 {
+  titanic_call_t *call = (titanic_call_t *)zmalloc(sizeof *call);
+  call->uuid = strdup(uuid);
+  call->offset = offset;
+
   /* Load request message, service will be first frame */
   char *filename = s_request_filename(uuid);
   FILE *file = fopen(filename, "r");
@@ -243,51 +303,23 @@ s_service_success(char *uuid)
 
   /* If the client already closed request, treat as successful */
   if (!file) {
-    return 1;
+    call->success = 1;
+    return call;
   }
 
-  zmsg_t *request = zmsg_load(file);
+  call->request = zmsg_load(file);
   fclose(file);
 
-  zframe_t *service = zmsg_pop(request);
-  char *service_name = zframe_strdup(service);
-
-  /* Create MDP client session with short timeout */
-  mdp_client_t *client = mdp_client_new("tcp://localhost:5555", false);
-  mdp_client_set_timeout(client, 1000);  /* 1 sec */
+  zframe_t *service = zmsg_pop(call->request);
+  call->service_name = zframe_strdup(service);
 
   /* Use MMI protocol to check if service is available */
   zmsg_t *mmi_request = zmsg_new();
   zmsg_add(mmi_request, service);
-  mdp_client_send(client, "mmi.service", &mmi_request);
-
-  zmsg_t *mmi_reply = mdp_client_recv(client, NULL, NULL);
-  int service_ok = (mmi_reply && zframe_streq(zmsg_first(mmi_reply), "200"));
-  zmsg_destroy(&mmi_reply);
-
-  int result = 0;
-  if(service_ok) {
-    mdp_client_send(client, service_name, &request);
-    zmsg_t *reply = mdp_client_recv(client, NULL, NULL);
-
-    if (reply) {
-      filename = s_reply_filename(uuid);
-      FILE *file = fopen(filename, "w");
-      assert(file);
-      zmsg_save(reply, file);
-      fclose(file);
-      free(filename);
-      result = 1;
-    }
-    zmsg_destroy(&reply);
-  }
-  else
-    zmsg_destroy(&request);
+  mdp_client_request(client, "mmi.service", &mmi_request,
+    s_service_checked, call);
 
-  mdp_client_destroy(&client);
-  free(service_name);
-
-  return result;
+  return call;
 }
 
 static void
@@ -349,20 +381,22 @@ int main(int argc, char *argv [])
     /* Brute force dispatcher */
     char entry[] = "?.......:.......:.......:.......:";
     FILE *file = fopen(TITANIC_DIR "/queue", "r+");
+    if (!file) {
+      continue;
+    }
 
-    while (file && fread(entry, 33, 1, file) == 1) {
+    /* Create MDP client session with short timeout */
+    mdp_client_t *client = mdp_client_new("tcp://localhost:5555", false);
+    mdp_client_set_timeout(client, 1000);  /* 1 sec */
+    zlist_t *calls = zlist_new();
+
+    while (fread(entry, 33, 1, file) == 1) {
       /* UUID is prefixed with '-' if still waiting */
       if (entry[0] == '-') {
         if (verbose) {
           printf ("I: processing request %s\n", entry + 1);
         }
-
-        if (s_service_success(entry + 1)) {
-          /* Mark queue entry as processed */
-          fseek(file, -33, SEEK_CUR);
-          fwrite("+", 1, 1, file);
-          fseek(file, 32, SEEK_CUR);
-        }
+        zlist_append(calls, s_service_call(client, entry + 1, ftell(file) - 33));
       }
 
       /* Skip end of line, LF or CRLF */
@@ -375,9 +409,21 @@ int main(int argc, char *argv [])
       }
     }
 
-    if (file) {
-      fclose (file);
+    /* Wait for the calls, then mark the queue entries that succeeded */
+    while (mdp_client_pending(client) && !zctx_interrupted) {
+      mdp_client_poll(client, NULL, NULL, -1);
+    }
+    titanic_call_t *call;
+    while ((call = (titanic_call_t *)zlist_pop(calls))) {
+      if (call->success) {
+        fseek(file, call->offset, SEEK_SET);
+        fwrite("+", 1, 1, file);
+      }
+      s_service_call_destroy(&call);
     }
+    zlist_destroy(&calls);
+    mdp_client_destroy(&client);
+    fclose (file);
   }
 
   /* shutdown the titanic services gracefully */